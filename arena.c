@@ -0,0 +1,140 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "mquery.h"
+
+#define	ARENA_CHUNK	(16 * 1024)
+#define	ARENA_ALIGN	_Alignof(max_align_t)
+
+struct	arena_chunk {
+	struct arena_chunk	*next;
+	size_t			 size; /* usable bytes in data[] */
+	size_t			 used;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk	*c, *next;
+	void			*p;
+
+	if (size > SIZE_MAX - ARENA_ALIGN - sizeof(*c))
+		errx((int)MQUERYLEVEL_SYSERR, "arena: %zu bytes requested",
+		    size);
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	c = a->cur;
+	if (c == NULL || c->size - c->used < size) {
+		/* chunks after the current one are free since the last reset */
+		next = c == NULL ? a->first : c->next;
+		if (next == NULL || next->size < size) {
+			next = malloc(sizeof(*next) +
+			    (size > ARENA_CHUNK ? size : ARENA_CHUNK));
+			if (next == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			next->size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+			next->used = 0;
+			if (c == NULL) {
+				next->next = a->first;
+				a->first = next;
+			} else {
+				next->next = c->next;
+				c->next = next;
+			}
+		}
+		a->cur = c = next;
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+void *
+arena_calloc(struct arena *a, size_t nmemb, size_t size)
+{
+	void	*p;
+
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		errx((int)MQUERYLEVEL_SYSERR, "arena: %zu * %zu bytes requested",
+		    nmemb, size);
+	p = arena_alloc(a, nmemb * size);
+	memset(p, 0, nmemb * size);
+	return p;
+}
+
+/*
+ * Resize p from oldsize to newsize bytes.  The last allocation grows in
+ * place while its chunk has room, anything else is copied and the old
+ * copy stays behind until the next reset.
+ */
+void *
+arena_grow(struct arena *a, void *p, size_t oldsize, size_t newsize)
+{
+	struct arena_chunk	*c;
+	size_t			 off, end;
+	void			*q;
+
+	c = a->cur;
+	if (p != NULL && c != NULL && (unsigned char *)p >= c->data &&
+	    (unsigned char *)p < c->data + c->size) {
+		off = (unsigned char *)p - c->data;
+		end = (oldsize + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+		if (off + end == c->used && newsize <= c->size - off) {
+			/* chunk sizes are aligned, so this still fits */
+			end = (newsize + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+			c->used = off + end;
+			return p;
+		}
+	}
+	q = arena_alloc(a, newsize);
+	if (oldsize > 0)
+		memcpy(q, p, oldsize < newsize ? oldsize : newsize);
+	return q;
+}
+
+char *
+arena_strndup(struct arena *a, const char *s, size_t len)
+{
+	char	*p;
+
+	p = arena_alloc(a, len + 1);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk	*c;
+
+	for (c = a->first; c != NULL; c = c->next)
+		c->used = 0;
+	a->cur = a->first;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arena_chunk	*c, *next;
+
+	for (c = a->first; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->first = a->cur = NULL;
+}
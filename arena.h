@@ -0,0 +1,26 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Bump allocator for memory that lives exactly as long as one document.
+ * Nothing is freed individually; arena_reset() recycles all chunks
+ * for the next document and arena_free() gives them back.
+ */
+
+struct	arena_chunk;
+
+struct	arena {
+	struct arena_chunk	*first;
+	struct arena_chunk	*cur;
+};
+
+void	*arena_alloc(struct arena *a, size_t size);
+void	*arena_calloc(struct arena *a, size_t nmemb, size_t size);
+void	*arena_grow(struct arena *a, void *p, size_t oldsize,
+		size_t newsize);
+char	*arena_strndup(struct arena *a, const char *s, size_t len);
+void	 arena_reset(struct arena *a);
+void	 arena_free(struct arena *a);
@@ -0,0 +1,240 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#define _GNU_SOURCE /* asprintf(), dl_iterate_phdr() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/*
+ * The cache directory, or NULL if caching is off.  It is also off if
+ * the build cannot be told apart from others, see cache_build().
+ */
+const char *
+cache_dir(void)
+{
+	const char	*dir;
+
+	dir = getenv("MQUERY_CACHE_DIR");
+	if (dir == NULL || *dir == '\0' || cache_build() == NULL)
+		return NULL;
+	return dir;
+}
+
+/*
+ * Copy the GNU build ID of the executable itself, the first object
+ * dl_iterate_phdr() reports, as hex into the buffer in data.
+ */
+static int
+build_id(struct dl_phdr_info *info, size_t size, void *data)
+{
+	const ElfW(Nhdr)	*nh;
+	const unsigned char	*p, *end, *id;
+	char			*hex = data;
+	size_t			 i;
+	int			 j;
+
+	for (j = 0; j < info->dlpi_phnum; j++) {
+		if (info->dlpi_phdr[j].p_type != PT_NOTE)
+			continue;
+		p = (const unsigned char *)info->dlpi_addr +
+		    info->dlpi_phdr[j].p_vaddr;
+		end = p + info->dlpi_phdr[j].p_memsz;
+		while ((size_t)(end - p) >= sizeof(*nh)) {
+			nh = (const ElfW(Nhdr) *)p;
+			p += sizeof(*nh) + ((nh->n_namesz + 3) & ~3U);
+			id = p;
+			p += (nh->n_descsz + 3) & ~3U;
+			if (p > end)
+				break;
+			if (nh->n_type != NT_GNU_BUILD_ID ||
+			    nh->n_namesz != 4 || memcmp(id - 4, "GNU", 4) != 0)
+				continue;
+			for (i = 0; i < nh->n_descsz && i < CACHE_KEYLEN / 2;
+			    i++)
+				snprintf(hex + 2 * i, 3, "%02x", id[i]);
+			break;
+		}
+	}
+	return 1; /* the libraries do not matter */
+}
+
+static char		build[CACHE_KEYLEN];
+static pthread_once_t	build_once = PTHREAD_ONCE_INIT;
+
+static void
+build_init(void)
+{
+	struct cache_hash	 ch;
+	char			 buf[BUFSIZ];
+	ssize_t			 nr;
+	int			 fd;
+
+	dl_iterate_phdr(build_id, build);
+	if (*build != '\0' ||
+	    (fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	cache_hash_init(&ch);
+	while ((nr = read(fd, buf, sizeof(buf))) != 0) {
+		if (nr == -1 && errno == EINTR)
+			continue;
+		if (nr == -1)
+			break;
+		cache_hash_add(&ch, buf, nr);
+	}
+	close(fd);
+	if (nr == 0)
+		cache_hash_key(&ch, build);
+}
+
+/*
+ * What identifies this build in cache keys and manifests, so that
+ * nothing written by another build of mquery or libmandoc, which is
+ * linked in statically, is ever reused: the GNU build ID of the
+ * executable, or a hash of its contents if it has none.  NULL if
+ * neither can be had.
+ */
+const char *
+cache_build(void)
+{
+	pthread_once(&build_once, build_init);
+	return *build == '\0' ? NULL : build;
+}
+
+void
+cache_hash_init(struct cache_hash *ch)
+{
+	ch->h = (unsigned __int128)0x6c62272e07bb0142ULL << 64 |
+	    0x62b821756295c58dULL;
+}
+
+void
+cache_hash_add(struct cache_hash *ch, const void *buf, size_t len)
+{
+	const unsigned char	*p = buf, *end = p + len;
+	unsigned __int128	 h, prime;
+
+	prime = (unsigned __int128)1 << 88 | 0x13b;
+	for (h = ch->h; p < end; p++)
+		h = (h ^ *p) * prime;
+	ch->h = h;
+}
+
+void
+cache_hash_key(const struct cache_hash *ch, char key[CACHE_KEYLEN])
+{
+	snprintf(key, CACHE_KEYLEN, "%016llx%016llx",
+	    (unsigned long long)(ch->h >> 64), (unsigned long long)ch->h);
+}
+
+/*
+ * Contents of an entry, or NULL if there is none.
+ */
+char *
+cache_load(const char *kind, const char *key, size_t *lenp)
+{
+	struct stat	 st;
+	char		*path, *buf;
+	size_t		 len;
+	ssize_t		 nr;
+	int		 fd;
+
+	if (cache_dir() == NULL ||
+	    asprintf(&path, "%s/%s/%s", cache_dir(), kind, key) == -1)
+		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return NULL;
+
+	buf = NULL;
+	if (fstat(fd, &st) == -1 || (buf = malloc(st.st_size + 1)) == NULL)
+		goto fail;
+	for (len = 0; len < (size_t)st.st_size; len += nr)
+		if ((nr = read(fd, buf + len, st.st_size - len)) <= 0) {
+			if (nr == -1 && errno == EINTR) {
+				nr = 0;
+				continue;
+			}
+			goto fail;
+		}
+	close(fd);
+	*lenp = len;
+	return buf;
+
+fail:
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Replace path by a file with the given contents in one step.
+ */
+int
+publish_file(const char *path, const void *buf, size_t len)
+{
+	char	*tmp;
+	size_t	 off;
+	ssize_t	 nw;
+	int	 fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) == -1)
+		return -1;
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1) {
+		free(tmp);
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	for (off = 0; off < len; off += nw)
+		if ((nw = write(fd, (const char *)buf + off, len - off)) <= 0) {
+			if (nw == -1 && errno == EINTR) {
+				nw = 0;
+				continue;
+			}
+			break;
+		}
+	if (close(fd) == -1 || off < len || rename(tmp, path) == -1) {
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/*
+ * Publish an entry.  Failures only cost a later miss.
+ */
+void
+cache_store(const char *kind, const char *key, const void *buf, size_t len)
+{
+	char	*path;
+
+	if (cache_dir() == NULL ||
+	    asprintf(&path, "%s/%s", cache_dir(), kind) == -1)
+		return;
+	mkdir(cache_dir(), 0777);
+	mkdir(path, 0777);
+	free(path);
+	if (asprintf(&path, "%s/%s/%s", cache_dir(), kind, key) == -1)
+		return;
+	publish_file(path, buf, len);
+	free(path);
+}
@@ -0,0 +1,31 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * On-disk cache under $MQUERY_CACHE_DIR, off when it is unset.
+ * Entries live in one subdirectory per kind and are published by
+ * writing a temporary file and renaming it into place, so readers
+ * in other processes see either nothing or a whole entry.
+ */
+
+#define	CACHE_KEYLEN	33 /* hex digest and NUL */
+
+/* FNV-1a, 128 bits */
+struct	cache_hash {
+	unsigned __int128	h;
+};
+
+const char	*cache_dir(void);
+const char	*cache_build(void);
+void		 cache_hash_init(struct cache_hash *ch);
+void		 cache_hash_add(struct cache_hash *ch, const void *buf,
+			size_t len);
+void		 cache_hash_key(const struct cache_hash *ch,
+			char key[CACHE_KEYLEN]);
+char		*cache_load(const char *kind, const char *key, size_t *lenp);
+void		 cache_store(const char *kind, const char *key,
+			const void *buf, size_t len);
+int		 publish_file(const char *path, const void *buf, size_t len);
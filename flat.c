@@ -0,0 +1,184 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mandoc/mandoc.h>
+#include <mandoc/roff.h>
+
+#include "arena.h"
+#include "flat.h"
+#include "mquery.h"
+
+static size_t	 deroff_copy(const struct roff_node *n, char *buf, size_t len);
+static void	 flat_count(const struct roff_node *n, uint32_t *nodec,
+			size_t *poolsz);
+static uint32_t	 flat_fill(struct flatdoc *doc, const struct roff_node *n,
+			uint32_t parent, uint32_t *nodec);
+
+/*
+ * The same joining and trimming rules as deroff(), into buf.
+ * With buf == NULL, only measure.
+ */
+static size_t
+deroff_copy(const struct roff_node *n, char *buf, size_t len)
+{
+	const char	*cp;
+	size_t		 sz;
+
+	if (n->string == NULL) {
+		for (n = n->child; n != NULL; n = n->next)
+			len = deroff_copy(n, buf, len);
+		return len;
+	}
+
+	/* skip leading whitespace */
+	for (cp = n->string; *cp != '\0'; cp++) {
+		if (cp[0] == '\\' && cp[1] != '\0' &&
+		    strchr(" %&0^|~", cp[1]) != NULL)
+			cp++;
+		else if (!isspace((unsigned char)*cp))
+			break;
+	}
+
+	/* skip trailing backslash and whitespace */
+	sz = strlen(cp);
+	if (sz > 0 && cp[sz - 1] == '\\')
+		sz--;
+	while (sz > 0 && isspace((unsigned char)cp[sz - 1]))
+		sz--;
+
+	if (sz == 0)
+		return len;
+	if (len > 0) {
+		if (buf != NULL)
+			buf[len] = ' ';
+		len++;
+	}
+	if (buf != NULL)
+		memcpy(buf + len, cp, sz);
+	return len + sz;
+}
+
+static void
+flat_count(const struct roff_node *n, uint32_t *nodec, size_t *poolsz)
+{
+	size_t	len;
+
+	++*nodec;
+	if (n->type == ROFFT_TEXT && n->string != NULL)
+		*poolsz += strlen(n->string) + 1;
+	if (n->head != NULL && (len = deroff_copy(n->head, NULL, 0)) > 0)
+		*poolsz += len + 1;
+	for (n = n->child; n != NULL; n = n->next)
+		flat_count(n, nodec, poolsz);
+}
+
+static uint32_t
+flat_fill(struct flatdoc *doc, const struct roff_node *n, uint32_t parent,
+		uint32_t *nodec)
+{
+	uint32_t	 i, c, prev;
+	size_t		 len;
+
+	i = (*nodec)++;
+	doc->tok[i] = n->tok;
+	doc->type[i] = n->type;
+	doc->flags[i] = n->flags;
+	doc->parent[i] = parent;
+	doc->child[i] = FLAT_NONE;
+	doc->next[i] = FLAT_NONE;
+	doc->line[i] = n->line;
+	doc->pos[i] = n->pos;
+
+	doc->text[i] = FLAT_NONE;
+	if (n->type == ROFFT_TEXT && n->string != NULL) {
+		len = strlen(n->string) + 1;
+		memcpy(doc->pool + doc->poolsz, n->string, len);
+		doc->text[i] = doc->poolsz;
+		doc->poolsz += len;
+	}
+
+	doc->htext[i] = FLAT_NONE;
+	if (n->head != NULL &&
+	    (len = deroff_copy(n->head, doc->pool + doc->poolsz, 0)) > 0) {
+		doc->pool[doc->poolsz + len] = '\0';
+		doc->htext[i] = doc->poolsz;
+		doc->poolsz += len + 1;
+	}
+
+	prev = FLAT_NONE;
+	for (n = n->child; n != NULL; n = n->next) {
+		c = flat_fill(doc, n, i, nodec);
+		if (prev == FLAT_NONE)
+			doc->child[i] = c;
+		else
+			doc->next[prev] = c;
+		prev = c;
+	}
+	return i;
+}
+
+/*
+ * Flatten the tree under root into arrays allocated from a.
+ * Node 0 is root itself.
+ */
+void
+flat_build(struct flatdoc *doc, struct arena *a, const struct roff_node *root)
+{
+	uint32_t	 nodec;
+	size_t		 poolsz;
+
+	nodec = 0;
+	poolsz = 0;
+	flat_count(root, &nodec, &poolsz);
+	if (poolsz >= FLAT_NONE || nodec >= FLAT_NONE)
+		errx((int)MQUERYLEVEL_UNSUPP, "document too large");
+
+	doc->nodec = nodec;
+	doc->tok = arena_alloc(a, nodec * sizeof(*doc->tok));
+	doc->type = arena_alloc(a, nodec * sizeof(*doc->type));
+	doc->flags = arena_alloc(a, nodec * sizeof(*doc->flags));
+	doc->parent = arena_alloc(a, nodec * sizeof(*doc->parent));
+	doc->child = arena_alloc(a, nodec * sizeof(*doc->child));
+	doc->next = arena_alloc(a, nodec * sizeof(*doc->next));
+	doc->text = arena_alloc(a, nodec * sizeof(*doc->text));
+	doc->htext = arena_alloc(a, nodec * sizeof(*doc->htext));
+	doc->line = arena_alloc(a, nodec * sizeof(*doc->line));
+	doc->pos = arena_alloc(a, nodec * sizeof(*doc->pos));
+	doc->pool = arena_alloc(a, poolsz + 1);
+	doc->poolsz = 0;
+
+	nodec = 0;
+	flat_fill(doc, root, FLAT_NONE, &nodec);
+}
+
+/*
+ * The HEAD or BODY child of a BLOCK, like n->head and n->body.
+ */
+uint32_t
+flat_head(const struct flatdoc *doc, uint32_t n)
+{
+	for (n = doc->child[n]; n != FLAT_NONE; n = doc->next[n])
+		if (doc->type[n] == ROFFT_HEAD)
+			return n;
+	return FLAT_NONE;
+}
+
+uint32_t
+flat_body(const struct flatdoc *doc, uint32_t n)
+{
+	for (n = doc->child[n]; n != FLAT_NONE; n = doc->next[n])
+		if (doc->type[n] == ROFFT_BODY)
+			return n;
+	return FLAT_NONE;
+}
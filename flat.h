@@ -0,0 +1,34 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * A parsed document flattened into arrays indexed by node number,
+ * in document order (preorder), with all strings in one pool.
+ * Needs <stdint.h>, <mandoc/roff.h> and "arena.h".
+ */
+
+#define	FLAT_NONE	UINT32_MAX
+
+struct	flatdoc {
+	uint32_t	 nodec;
+	uint16_t	*tok; /* enum roff_tok */
+	uint8_t		*type; /* enum roff_type */
+	int		*flags; /* NODE_* */
+	uint32_t	*parent;
+	uint32_t	*child; /* first child */
+	uint32_t	*next; /* next sibling */
+	uint32_t	*text; /* string of TEXT nodes, into pool */
+	uint32_t	*htext; /* deroffed head of BLOCK nodes, into pool */
+	int		*line;
+	int		*pos;
+	char		*pool;
+	uint32_t	 poolsz;
+};
+
+void		 flat_build(struct flatdoc *doc, struct arena *a,
+			const struct roff_node *root);
+uint32_t	 flat_head(const struct flatdoc *doc, uint32_t n);
+uint32_t	 flat_body(const struct flatdoc *doc, uint32_t n);
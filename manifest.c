@@ -0,0 +1,378 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#define _GNU_SOURCE /* asprintf() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <mandoc/mandoc.h>
+#include <mandoc/roff.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "flat.h"
+#include "manifest.h"
+#include "mquery.h"
+
+/*
+ * File format, one record per line:
+ *
+ *	header
+ *	P key status name	for each page
+ *	S key name		for each of its top-level sections
+ */
+#define	KEYEND	(2 + CACHE_KEYLEN - 1) /* offset of the blank after key */
+
+static int	 page_cmp(const void *a, const void *b);
+static void	 free_sections(struct mpage *p);
+static void	 hash_subtree(const struct flatdoc *doc, uint32_t n,
+			char key[CACHE_KEYLEN]);
+
+static int
+page_cmp(const void *a, const void *b)
+{
+	const struct mpage	*pa = a, *pb = b;
+
+	return strcmp(pa->name, pb->name);
+}
+
+static void
+free_sections(struct mpage *p)
+{
+	int	i;
+
+	for (i = 0; i < p->sectc; i++)
+		free(p->sect[i].name);
+	free(p->sect);
+	p->sect = NULL;
+	p->sectc = 0;
+}
+
+/*
+ * Hash everything the queries can see below n: the shape of the
+ * subtree, macros, flags and text, but not line numbers.
+ */
+static void
+hash_subtree(const struct flatdoc *doc, uint32_t n, char key[CACHE_KEYLEN])
+{
+	struct cache_hash	 ch;
+	uint32_t		 rec[4], end, i, m;
+
+	/* in preorder, the subtree ends where the next sibling starts */
+	for (m = n; m != FLAT_NONE && doc->next[m] == FLAT_NONE;
+	     m = doc->parent[m])
+		continue;
+	end = m == FLAT_NONE ? doc->nodec : doc->next[m];
+
+	cache_hash_init(&ch);
+	for (i = n; i < end; i++) {
+		rec[0] = doc->tok[i];
+		rec[1] = doc->type[i];
+		rec[2] = (uint32_t)doc->flags[i];
+		rec[3] = i == n ? 0 : i - doc->parent[i];
+		cache_hash_add(&ch, rec, sizeof(rec));
+		if (doc->text[i] != FLAT_NONE)
+			cache_hash_add(&ch, doc->pool + doc->text[i],
+			    strlen(doc->pool + doc->text[i]) + 1);
+	}
+	cache_hash_key(&ch, key);
+}
+
+/*
+ * Read the manifest at path.  A missing file or one written for
+ * another header leaves m empty.
+ */
+void
+manifest_load(struct manifest *m, const char *path, const char *header)
+{
+	struct mpage	*p;
+	struct msection	*s;
+	FILE		*f;
+	char		*line;
+	size_t		 linesz;
+	ssize_t		 len;
+	int		 status, off;
+
+	memset(m, 0, sizeof(*m));
+	if ((f = fopen(path, "re")) == NULL)
+		return;
+
+	line = NULL;
+	linesz = 0;
+	p = NULL;
+	if ((len = getline(&line, &linesz, f)) <= 0 ||
+	    (size_t)len != strlen(header) + 1 ||
+	    strncmp(line, header, len - 1) != 0)
+		goto out;
+
+	while ((len = getline(&line, &linesz, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len <= KEYEND || line[1] != ' ' || line[KEYEND] != ' ')
+			goto bad;
+		line[KEYEND] = '\0';
+
+		if (line[0] == 'P') {
+			if (sscanf(line + KEYEND + 1, "%d %n", &status,
+			    &off) != 1)
+				goto bad;
+			p = manifest_add(m, line + KEYEND + 1 + off);
+			memcpy(p->key, line + 2, CACHE_KEYLEN);
+			p->status = status;
+		} else if (line[0] == 'S' && p != NULL) {
+			if ((s = reallocarray(p->sect, p->sectc + 1,
+			    sizeof(*s))) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			p->sect = s;
+			s += p->sectc++;
+			memcpy(s->key, line + 2, CACHE_KEYLEN);
+			if ((s->name = strdup(line + KEYEND + 1)) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+		} else
+			goto bad;
+	}
+	manifest_sort(m);
+	goto out;
+
+bad:
+	warnx("%s: ignoring damaged manifest", path);
+	manifest_free(m);
+out:
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Write m to path, replacing the old manifest in one step.
+ */
+int
+manifest_save(const struct manifest *m, const char *path, const char *header)
+{
+	const struct mpage	*p;
+	FILE			*f;
+	char			*tmp;
+	int			 fd, i, j;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) == -1)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1 ||
+	    (f = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmp);
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return -1;
+	}
+	fchmod(fd, 0644);
+
+	fprintf(f, "%s\n", header);
+	for (i = 0; i < m->pagec; i++) {
+		p = &m->pages[i];
+		/* such a page is simply done again next time */
+		if (strchr(p->name, '\n') != NULL)
+			continue;
+		fprintf(f, "P %s %d %s\n", p->key, p->status, p->name);
+		for (j = 0; j < p->sectc; j++)
+			fprintf(f, "S %s %s\n", p->sect[j].key,
+			    p->sect[j].name);
+	}
+
+	if (fclose(f) == EOF || rename(tmp, path) == -1) {
+		warn("%s", path);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+void
+manifest_free(struct manifest *m)
+{
+	int	i;
+
+	for (i = 0; i < m->pagec; i++) {
+		free_sections(&m->pages[i]);
+		free(m->pages[i].name);
+	}
+	free(m->pages);
+	memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Sort pages by name for manifest_find().
+ */
+void
+manifest_sort(struct manifest *m)
+{
+	qsort(m->pages, m->pagec, sizeof(m->pages[0]), page_cmp);
+}
+
+/*
+ * Look up a page in a sorted manifest.
+ */
+struct mpage *
+manifest_find(struct manifest *m, const char *name)
+{
+	struct mpage	key;
+
+	if (m->pagec == 0)
+		return NULL;
+	key.name = (char *)name;
+	return bsearch(&key, m->pages, m->pagec, sizeof(m->pages[0]),
+		       page_cmp);
+}
+
+/*
+ * Append an empty page.  The pointer is good until the next call.
+ */
+struct mpage *
+manifest_add(struct manifest *m, const char *name)
+{
+	struct mpage	*p;
+
+	if (m->pagec == m->pagemax) {
+		m->pagemax = m->pagemax == 0 ? 64 : m->pagemax * 2;
+		if ((p = reallocarray(m->pages, m->pagemax,
+		    sizeof(*p))) == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		m->pages = p;
+	}
+	p = &m->pages[m->pagec++];
+	memset(p, 0, sizeof(*p));
+	if ((p->name = strdup(name)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	return p;
+}
+
+/*
+ * Drop a page from a sorted manifest.
+ */
+void
+manifest_remove(struct manifest *m, const char *name)
+{
+	struct mpage	*p;
+
+	if ((p = manifest_find(m, name)) == NULL)
+		return;
+	free_sections(p);
+	free(p->name);
+	memmove(p, p + 1, (m->pages + --m->pagec - p) * sizeof(*p));
+}
+
+/*
+ * Put the pages of src into the sorted manifest m, replacing pages
+ * of the same name.
+ */
+void
+manifest_merge(struct manifest *m, const struct manifest *src)
+{
+	int	i;
+
+	for (i = 0; i < src->pagec; i++)
+		manifest_remove(m, src->pages[i].name);
+	for (i = 0; i < src->pagec; i++)
+		manifest_copy(manifest_add(m, src->pages[i].name),
+		    &src->pages[i]);
+	manifest_sort(m);
+}
+
+/*
+ * Take over the key, status and sections of src.
+ */
+void
+manifest_copy(struct mpage *dst, const struct mpage *src)
+{
+	int	i;
+
+	free_sections(dst);
+	memcpy(dst->key, src->key, CACHE_KEYLEN);
+	dst->status = src->status;
+	if (src->sectc == 0)
+		return;
+	if ((dst->sect = reallocarray(NULL, src->sectc,
+	    sizeof(dst->sect[0]))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	for (i = 0; i < src->sectc; i++) {
+		memcpy(dst->sect[i].key, src->sect[i].key, CACHE_KEYLEN);
+		if ((dst->sect[i].name = strdup(src->sect[i].name)) == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+	}
+	dst->sectc = src->sectc;
+}
+
+/*
+ * Record the top-level sections of doc.
+ */
+void
+manifest_sections(struct mpage *p, const struct flatdoc *doc)
+{
+	struct msection	*s;
+	uint32_t	 n;
+
+	free_sections(p);
+	for (n = doc->child[0]; n != FLAT_NONE; n = doc->next[n])
+		if (doc->tok[n] == MDOC_Sh)
+			p->sectc++;
+	if (p->sectc == 0)
+		return;
+	if ((p->sect = reallocarray(NULL, p->sectc, sizeof(*s))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+
+	s = p->sect;
+	for (n = doc->child[0]; n != FLAT_NONE; n = doc->next[n]) {
+		if (doc->tok[n] != MDOC_Sh)
+			continue;
+		s->name = strdup(doc->htext[n] == FLAT_NONE ? "" :
+		    doc->pool + doc->htext[n]);
+		if (s->name == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		hash_subtree(doc, n, s->key);
+		s++;
+	}
+}
+
+/*
+ * Whether a query that only looks at the named sections gives the
+ * same result on p as on old: the section list is the same and the
+ * first section matching each name, as first_node_by_name() finds
+ * it, did not change.
+ */
+int
+manifest_same(const struct mpage *old, const struct mpage *p,
+		const char *const names[], int namec)
+{
+	int	i, j;
+
+	if (old == NULL || old->sectc != p->sectc)
+		return 0;
+	for (i = 0; i < p->sectc; i++)
+		if (strcmp(old->sect[i].name, p->sect[i].name) != 0)
+			return 0;
+
+	for (i = 0; i < namec; i++) {
+		for (j = 0; j < p->sectc; j++)
+			if (strcasecmp(p->sect[j].name, names[i]) == 0)
+				break;
+		if (j == p->sectc ||
+		    strcmp(old->sect[j].key, p->sect[j].key) != 0)
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,46 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * What a -O run produced: for every page the hash of its contents,
+ * the status of its query and the hashes of its top-level sections.
+ * Needs <stdint.h>, "cache.h" and "flat.h".
+ */
+
+struct	msection {
+	char		*name; /* deroffed head */
+	char		 key[CACHE_KEYLEN]; /* hash of the subtree */
+};
+
+struct	mpage {
+	char		*name;
+	char		 key[CACHE_KEYLEN]; /* hash of the contents */
+	struct msection	*sect; /* in document order */
+	int		 sectc;
+	int		 status;
+	int		 seen; /* still part of the corpus */
+};
+
+struct	manifest {
+	struct mpage	*pages;
+	int		 pagec;
+	int		 pagemax;
+};
+
+void		 manifest_load(struct manifest *m, const char *path,
+			const char *header);
+int		 manifest_save(const struct manifest *m, const char *path,
+			const char *header);
+void		 manifest_free(struct manifest *m);
+void		 manifest_sort(struct manifest *m);
+struct mpage	*manifest_find(struct manifest *m, const char *name);
+struct mpage	*manifest_add(struct manifest *m, const char *name);
+void		 manifest_remove(struct manifest *m, const char *name);
+void		 manifest_merge(struct manifest *m, const struct manifest *src);
+void		 manifest_copy(struct mpage *dst, const struct mpage *src);
+void		 manifest_sections(struct mpage *p, const struct flatdoc *doc);
+int		 manifest_same(const struct mpage *old, const struct mpage *p,
+			const char *const names[], int namec);
@@ -4,112 +4,617 @@
  * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
  */
 
+#define _GNU_SOURCE /* memfd_create() */
+
 #include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <regex.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
 #include <mandoc/mandoc.h>
 #include <mandoc/roff.h>
 #include <mandoc/mandoc_parse.h>
 
+#include "arena.h"
+#include "cache.h"
+#include "flat.h"
+#include "manifest.h"
+#include "mquery.h"
+#include "mstats.h"
+#include "scan.h"
+#include "selector.h"
+#include "uring.h"
+#include "pipeline.h"
+#include "stream.h"
+#include "tar.h"
+
 extern char	*program_invocation_short_name;
 
+/*
+ * USDT probes, compiled in with -DHAVE_SYS_SDT_H (make SDT=1).
+ * Provider "mquery", all string arguments are NUL-terminated and never
+ * NULL:
+ *
+ *	parse__start(file, flag, inbytes)	before mparse_readfd()
+ *	parse__done(file, flag, inbytes, status)
+ *	result__start(file, flag, inbytes)	before mparse_result()
+ *	result__done(file, flag, inbytes)	after mparse_result()
+ *	query__start(file, flag, itemname)	before query dispatch
+ *	query__done(file, flag, status, outbytes)
+ *	flush__start(file, flag, outbytes)	before flushing stdout
+ *	flush__done(file, flag, outbytes)
+ *
+ * parse__done fires on every path out of parsing; status is the
+ * MQUERYLEVEL_* code, nonzero when the page failed to parse or lacks
+ * the section, in which case no result__* probes follow.
+ *
+ * Without sys/sdt.h the macros expand to nothing and their arguments
+ * are never evaluated.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define	PROBE3(name, a, b, c)	  DTRACE_PROBE3(mquery, name, a, b, c)
+#define	PROBE4(name, a, b, c, d)  DTRACE_PROBE4(mquery, name, a, b, c, d)
+
+static long long
+probe_insize(int fd, size_t len)
+{
+	struct stat	st;
+
+	if (fd == -1)
+		return (long long)len;
+	return fstat(fd, &st) == -1 ? -1 : (long long)st.st_size;
+}
+#else
+#define	PROBE3(name, a, b, c)	  do { } while (0)
+#define	PROBE4(name, a, b, c, d)  do { } while (0)
+#endif
+
 #define		 VAR_SUB_COUNT 4
 const char	*var_subsections[VAR_SUB_COUNT] = { "Required variables",
 						    "Optional variables",
 						    "Output variables",
 						    "User variables" };
 
-enum	mquerylevel {
-	MQUERYLEVEL_OK = 0, /* succesful query */
-	MQUERYLEVEL_NOTFOUND, /* failed query */
-	MQUERYLEVEL_ERROR,  /* invalid input document */
-	MQUERYLEVEL_UNSUPP, /* input needs unimplemented features */
-	MQUERYLEVEL_BADARG, /* bad argument in invocation */
-	MQUERYLEVEL_SYSERR, /* system error */
-	MQUERYLEVEL_MAX
-};
-
 struct	enclosure {
 	const char	*before;
 	const char	*after;
 };
 
-int	global_query(struct roff_node *mdoc, char opt);
-int	function_query(struct roff_node *mdoc, const char *funcname, char opt);
-int	variable_query(struct roff_node *mdoc, const char *varname, char opt);
+/*
+ * Top-level sections and subsections of a page by their heads, found
+ * once so that queries do not each search the whole tree.  The arrays
+ * are allocated from doc_arena.
+ */
+struct	sectindex {
+	uint32_t	*sect; /* .Sh blocks in page order */
+	uint32_t	*sub; /* .Ss blocks in page order */
+	int		 sectc;
+	int		 subc;
+};
+
+/* What was asked for on the command line. */
+struct	query {
+	const char	*itemname; /* -F or -V argument, or -q selector */
+	const char	*outdir; /* -O argument */
+	int		 watch; /* -w */
+	int		 tar; /* -t */
+	int		 stream; /* -g, -z or -Z */
+	enum stream_kind kind;
+	int		 functionq; /* invoked as mquery-function */
+	int		 variableq; /* invoked as mquery-variable */
+	char		 flag; /* query option, or QUERY_MULTI */
+	char		 flags[16]; /* all query options, in order */
+	const char	*filter; /* -x argument */
+	char		 listopts[4]; /* -s, -u and -0, for keys */
+};
+
+#define	QUERY_MULTI	'+' /* flag of several global queries */
 
-int	print_item_heads(struct roff_node *n, enum roff_tok macro, int errflag);
-int	print_item_bodies(struct roff_node *n, enum roff_tok macro,
-		const char prepend_text[], int errflag);
+int	global_query(const struct flatdoc *doc, const struct sectindex *si,
+		char opt);
+int	function_query(const struct flatdoc *doc, uint32_t mdoc,
+		const char *funcname, char opt);
+int	variable_query(const struct flatdoc *doc, uint32_t mdoc,
+		const char *varname, char opt);
 
+int	print_item_heads(const struct flatdoc *doc, uint32_t n,
+		enum roff_tok macro, int errflag);
+int	print_item_bodies(const struct flatdoc *doc, uint32_t n,
+		enum roff_tok macro, const char prepend_text[], int errflag);
+
+static void	ochar(int c);
+static void	ostring(const char *s);
 static void	pstring(const char *p, int flags);
-int		deroff_print(const struct roff_node *n);
+int		deroff_print(const struct flatdoc *doc, uint32_t n);
+
+uint32_t	first_node_by_macro(const struct flatdoc *doc, uint32_t n,
+			enum roff_tok macro, int errflag);
+uint32_t	first_node_by_name(const struct flatdoc *doc, uint32_t n,
+			const char section_name[], int errflag);
+void		section_index(const struct flatdoc *doc, uint32_t mdoc,
+			struct sectindex *si);
+uint32_t	section_find(const struct flatdoc *doc,
+			const struct sectindex *si, const char section_name[],
+			int errflag);
+
+struct	item {
+	char		*name; /* deroffed */
+	size_t		 len; /* without trailing blanks */
+	uint32_t	 node;
+	const char	*sub; /* subsection of a variable, or "" */
+};
 
-struct roff_node	*first_node_by_macro(struct roff_node *n,
-				enum roff_tok macro, int errflag);
-struct roff_node	*first_node_by_name(struct roff_node *n,
-				const char section_name[], int errflag);
+/* Items print_item_heads() collects instead of printing them. */
+static struct itemvec {
+	struct item	*v;
+	size_t		 c;
+	size_t		 max;
+	const char	*sub; /* subsection being walked */
+} *icollect;
+
+/* Scratch memory of the current document. */
+static struct arena	doc_arena;
+
+/* The -q selector, compiled once for all pages. */
+static struct selector	*qselector;
+
+/* -T, how results are laid out. */
+static enum output_format {
+	OUTPUT_TEXT = 0,
+	OUTPUT_BINARY,
+	OUTPUT_SHELL
+} oformat;
+
+static const char *const formats[] = { "text", "binary", "shell" };
+
+/* Variables of -T shell by query option, with their declare flag. */
+static const struct shellvar {
+	char		 opt;
+	const char	*name;
+	const char	*decl;
+} shellvars[] = {
+	{ 'B', "blurb", "--" },
+	{ 'D', "description", "--" },
+	{ 'F', "functions", "-a" },
+	{ 'H', "header", "--" },
+	{ 'I', "items", "-A" },
+	{ 'S', "sections", "--" },
+	{ 'V', "variables", "-A" },
+	{ 'a', "authors", "-a" },
+	{ 'b', "bugreports", "--" },
+	{ 'd', "deprecated", "--" },
+	{ 'e', "examples", "--" },
+	{ 'm', "maintainers", "-a" },
+	{ 'q', "matches", "-a" },
+};
+
+/* -x, -s, -u and -0, applied to the item lists of all pages. */
+static struct {
+	regex_t		 re;
+	int		 filter;
+	int		 sort;
+	int		 unique;
+	int		 nul;
+} itemopts;
 
 /*
  * Search for macro name recursively.
  */
-struct roff_node *
-first_node_by_macro(struct roff_node *n, enum roff_tok macro, int errflag)
+uint32_t
+first_node_by_macro(const struct flatdoc *doc, uint32_t n,
+		enum roff_tok macro, int errflag)
 {
-	struct roff_node	*nfound;
+	uint32_t	nfound;
 
-	if (n == NULL)
-		return NULL;
+	if (n == FLAT_NONE)
+		return FLAT_NONE;
 
-	for (; n != NULL; n = n->child) {
-		if (n->tok == macro)
+	for (; n != FLAT_NONE; n = doc->child[n]) {
+		if (doc->tok[n] == macro)
 			return n;
 
-		nfound = first_node_by_macro(n->next, macro, 0);
-		if (nfound != NULL)
+		nfound = first_node_by_macro(doc, doc->next[n], macro, 0);
+		if (nfound != FLAT_NONE)
 			return nfound;
 	}
 
-	if (!errflag)
-		return NULL;
-	errx((int)MQUERYLEVEL_NOTFOUND, "macro %d not found", macro);
+	if (errflag)
+		warnx("macro %d not found", macro);
+	return FLAT_NONE;
 }
 
 /*
  * Search for header text recursively.
  */
-struct roff_node *
-first_node_by_name(struct roff_node *n, const char section_name[], int errflag)
+uint32_t
+first_node_by_name(const struct flatdoc *doc, uint32_t n,
+		const char section_name[], int errflag)
 {
-	struct roff_node	*nfound;
-	char			*head_text = NULL;
+	uint32_t	nfound;
 
-	if (n == NULL)
-		return NULL;
+	if (n == FLAT_NONE)
+		return FLAT_NONE;
 
-	for (; n != NULL; n = n->child) {
-		if(n->head != NULL) {
-			deroff(&head_text, n->head);
-			if (head_text != NULL && strcasecmp(head_text, section_name) == 0)
-				return n;
-		}
+	for (; n != FLAT_NONE; n = doc->child[n]) {
+		if (doc->htext[n] != FLAT_NONE &&
+		    strcasecmp(doc->pool + doc->htext[n], section_name) == 0)
+			return n;
 
-		nfound = first_node_by_name(n->next, section_name, 0);
-		if (nfound != NULL)
+		nfound = first_node_by_name(doc, doc->next[n], section_name, 0);
+		if (nfound != FLAT_NONE)
 			return nfound;
 	}
 
-	if (!errflag)
-		return NULL;
-	errx((int)MQUERYLEVEL_NOTFOUND, "section not found: %s", section_name);
+	if (errflag)
+		warnx("section not found: %s", section_name);
+	return FLAT_NONE;
+}
+
+/*
+ * Index the sections of a page: the .Sh blocks at the top level and
+ * the .Ss blocks right in their bodies.  section_find() prefers a
+ * section to a subsection of the same name and takes subsections in
+ * page order.  This is not the order of first_node_by_name(), which
+ * reaches nested blocks of later sections first and also matches the
+ * heads of other blocks such as .It or .Bl.
+ */
+void
+section_index(const struct flatdoc *doc, uint32_t mdoc, struct sectindex *si)
+{
+	uint32_t	n, m;
+	int		pass;
+
+	/* count the blocks, then fill arrays of the right size */
+	si->sect = si->sub = NULL;
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			si->sect = arena_calloc(&doc_arena, si->sectc,
+			    sizeof(*si->sect));
+			si->sub = arena_calloc(&doc_arena, si->subc,
+			    sizeof(*si->sub));
+		}
+		si->sectc = si->subc = 0;
+		for (n = mdoc; n != FLAT_NONE; n = doc->next[n]) {
+			if (doc->tok[n] != MDOC_Sh ||
+			    doc->type[n] != ROFFT_BLOCK)
+				continue;
+			if (si->sect != NULL)
+				si->sect[si->sectc] = n;
+			si->sectc++;
+			if ((m = flat_body(doc, n)) == FLAT_NONE)
+				continue;
+			for (m = doc->child[m]; m != FLAT_NONE;
+			     m = doc->next[m]) {
+				if (doc->tok[m] != MDOC_Ss ||
+				    doc->type[m] != ROFFT_BLOCK)
+					continue;
+				if (si->sub != NULL)
+					si->sub[si->subc] = m;
+				si->subc++;
+			}
+		}
+	}
+}
+
+/*
+ * Look up a section or subsection by its head.
+ */
+uint32_t
+section_find(const struct flatdoc *doc, const struct sectindex *si,
+		const char section_name[], int errflag)
+{
+	int	i;
+
+	for (i = 0; i < si->sectc; i++)
+		if (doc->htext[si->sect[i]] != FLAT_NONE &&
+		    strcasecmp(doc->pool + doc->htext[si->sect[i]],
+		    section_name) == 0)
+			return si->sect[i];
+	for (i = 0; i < si->subc; i++)
+		if (doc->htext[si->sub[i]] != FLAT_NONE &&
+		    strcasecmp(doc->pool + doc->htext[si->sub[i]],
+		    section_name) == 0)
+			return si->sub[i];
+
+	if (errflag)
+		warnx("section not found: %s", section_name);
+	return FLAT_NONE;
+}
+
+static size_t	 outbytes; /* bytes emitted so far */
+static int	 obuffered; /* collect output in obuf instead of stdout */
+static int	 ocapture; /* obuf is a capture in doc_arena */
+static char	*obuf;
+static size_t	 obuflen, obufsize;
+
+static void
+obuf_grow(size_t need)
+{
+	size_t	 size;
+	char	*p;
+
+	if (obuflen + need <= obufsize)
+		return;
+	size = obufsize != 0 ? obufsize : ocapture ? 128 : 4096;
+	while (obuflen + need > size)
+		size *= 2;
+	if (ocapture)
+		p = arena_grow(&doc_arena, obuf, obufsize, size);
+	else if ((p = realloc(obuf, size)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	obuf = p;
+	obufsize = size;
+}
+
+/*
+ * All query output goes through these two.
+ */
+static void
+ochar(int c)
+{
+	if (obuffered) {
+		if (obuflen == obufsize)
+			obuf_grow(1);
+		obuf[obuflen++] = c;
+	} else
+		putchar(c);
+	outbytes++;
+}
+
+static void
+owrite(const char *s, size_t len)
+{
+	if (len == 0)
+		return;
+	if (obuffered) {
+		obuf_grow(len);
+		memcpy(obuf + obuflen, s, len);
+		obuflen += len;
+	} else
+		fwrite(s, 1, len, stdout);
+	outbytes += len;
+}
+
+static void
+ostring(const char *s)
+{
+	owrite(s, strlen(s));
+}
+
+/*
+ * Output collected in a string of its own, to be laid out by the
+ * caller, see capture_start().  The string is allocated from doc_arena
+ * and lives until the end of the page.
+ */
+struct	capture {
+	char	*buf;
+	size_t	 len;
+	size_t	 size;
+	size_t	 bytes;
+	int	 buffered;
+	int	 capture;
+};
+
+static void
+capture_start(struct capture *c)
+{
+	c->buf = obuf;
+	c->len = obuflen;
+	c->size = obufsize;
+	c->bytes = outbytes;
+	c->buffered = obuffered;
+	c->capture = ocapture;
+	obuf = NULL;
+	obuflen = obufsize = 0;
+	obuffered = 1;
+	ocapture = 1;
+}
+
+/*
+ * The output since capture_start().
+ */
+static char *
+capture_end(struct capture *c)
+{
+	char	*text;
+
+	obuf_grow(1);
+	obuf[obuflen] = '\0';
+	text = obuf;
+	obuf = c->buf;
+	obuflen = c->len;
+	obufsize = c->size;
+	outbytes = c->bytes;
+	obuffered = c->buffered;
+	ocapture = c->capture;
+	return text;
+}
+
+static int
+capture_query(const struct flatdoc *doc, const struct sectindex *si, char opt,
+		char **textp)
+{
+	struct capture	c;
+	int		status;
+
+	capture_start(&c);
+	status = global_query(doc, si, opt);
+	*textp = capture_end(&c);
+	return status;
+}
+
+static void
+oword(uint32_t v)
+{
+	ochar(v >> 24 & 0xff);
+	ochar(v >> 16 & 0xff);
+	ochar(v >> 8 & 0xff);
+	ochar(v & 0xff);
+}
+
+/*
+ * Emit a record of -T binary: the field, the source line and column,
+ * then the item name, the subsection and the text, each after its
+ * length.  Numbers are 32-bit big-endian.
+ */
+static void
+orecord(char field, const char *item, const char *sub, const char *text,
+		int line, int pos)
+{
+	ochar(field);
+	oword(line);
+	oword(pos);
+	oword(strlen(item));
+	ostring(item);
+	oword(strlen(sub));
+	ostring(sub);
+	oword(strlen(text));
+	ostring(text);
+}
+
+/*
+ * Emit an item of a -0 list: runs of blanks and newlines become one
+ * space, none are left at the ends and a NUL ends it.
+ */
+static void
+onul(const char *s, size_t len)
+{
+	const char	*end;
+	int		 blank;
+
+	end = s + len;
+	while (s < end && isspace((unsigned char)*s))
+		s++;
+	for (blank = 0; s < end; s++) {
+		if (isspace((unsigned char)*s)) {
+			blank = 1;
+			continue;
+		}
+		if (blank)
+			ochar(' ');
+		blank = 0;
+		ochar((unsigned char)*s);
+	}
+	ochar('\0');
+}
+
+/*
+ * Emit s without surrounding blanks as one single-quoted shell word.
+ */
+static void
+oquote(const char *s, size_t len)
+{
+	const char	*end, *q;
+
+	end = s + len;
+	while (s < end && isspace((unsigned char)*s))
+		s++;
+	while (end > s && isspace((unsigned char)end[-1]))
+		end--;
+	ochar('\'');
+	for (; (q = memchr(s, '\'', end - s)) != NULL; s = q + 1) {
+		owrite(s, q - s);
+		ostring("'\\''");
+	}
+	owrite(s, end - s);
+	ochar('\'');
+}
+
+static const struct shellvar *
+shellvar(char opt)
+{
+	size_t	i;
+
+	for (i = 0; i < sizeof(shellvars) / sizeof(shellvars[0]); i++)
+		if (shellvars[i].opt == opt)
+			break;
+	assert(i < sizeof(shellvars) / sizeof(shellvars[0]));
+	return &shellvars[i];
+}
+
+/*
+ * Start the -T shell declaration of the variable of opt.
+ */
+static void
+odeclare(char opt)
+{
+	const struct shellvar	*sv;
+
+	sv = shellvar(opt);
+	ostring("declare ");
+	ostring(sv->decl);
+	ochar(' ');
+	ostring(sv->name);
+	ochar('=');
+	if (sv->decl[1] != '-')
+		ochar('(');
+}
+
+/*
+ * Introduce the output for page fn in a run over several pages.
+ */
+static void
+page_header(int first, const char *fn)
+{
+	if (oformat == OUTPUT_BINARY) {
+		orecord('=', "", "", fn, 0, 0);
+		return;
+	}
+	if (oformat == OUTPUT_SHELL) {
+		ostring("declare -- page=");
+		oquote(fn, strlen(fn));
+		ochar('\n');
+		return;
+	}
+	ostring(first ? "==> " : "\n==> ");
+	ostring(fn);
+	ostring(" <==\n");
+}
+
+/*
+ * Collect the item element for filter_items(), see icollect.
+ */
+static void
+item_add(const struct flatdoc *doc, uint32_t element)
+{
+	struct capture	 c;
+	struct item	*it;
+
+	if (icollect->c == icollect->max) {
+		icollect->max = icollect->max == 0 ? 64 : icollect->max * 2;
+		icollect->v = arena_grow(&doc_arena, icollect->v,
+		    icollect->c * sizeof(*it), icollect->max * sizeof(*it));
+	}
+	it = &icollect->v[icollect->c++];
+	capture_start(&c);
+	deroff_print(doc, element);
+	it->name = capture_end(&c);
+	for (it->len = strlen(it->name); it->len > 0 &&
+	     isspace((unsigned char)it->name[it->len - 1]); it->len--)
+		continue;
+	it->node = element;
+	it->sub = icollect->sub;
 }
 
 /*
@@ -124,7 +629,7 @@ pstring(const char *p, int flags)
 	/* strip spaces at the beginning of line */
 	while (' ' == *p) {
 		if ((flags & NODE_NOFILL) != 0)
-			putchar((unsigned char )*p);
+			ochar((unsigned char )*p);
 		p++;
 	}
 
@@ -145,7 +650,7 @@ pstring(const char *p, int flags)
 					continue;
 				}
 			last_ch = *p;
-			putchar((unsigned char )*p++);
+			ochar((unsigned char )*p++);
 		}
 }
 
@@ -153,23 +658,27 @@ pstring(const char *p, int flags)
  * Lame and buggy as hell reimplementation of deroff().
  */
 int
-deroff_print(const struct roff_node *n)
+deroff_print(const struct flatdoc *doc, uint32_t n)
 {
 	enum roff_type		ntype;
+	uint32_t		parent, pnext;
+	int			flags;
 	struct enclosure	enc_text = { "", "" },
 				enc_macro = { " ", " " };
 
-	assert(n);
-	assert(n->parent);
+	assert(n != FLAT_NONE);
+	assert(doc->parent[n] != FLAT_NONE);
 
-	if ((n->flags & NODE_NOPRT) != 0)
+	flags = doc->flags[n];
+	parent = doc->parent[n];
+	if ((flags & NODE_NOPRT) != 0)
 		return (int)MQUERYLEVEL_OK;
 
-	switch (n->tok) {
+	switch (doc->tok[n]) {
 		/* handle '.An -split' */
 		case MDOC_An:
 			enc_macro.before = "";
-			if (n->child == NULL) {
+			if (doc->child[n] == FLAT_NONE) {
 				enc_macro.after = "";
 			}
 			break;
@@ -197,12 +706,12 @@ deroff_print(const struct roff_node *n)
 		case MDOC_Pa:
 			break;
 		default:
-			if ((n->flags & NODE_LINE) != 0 || n->parent->tok == MDOC_It)
+			if ((flags & NODE_LINE) != 0 || doc->tok[parent] == MDOC_It)
 				enc_macro.before = "";
 			break;
 	}
 
-	switch (n->parent->tok) {
+	switch (doc->tok[parent]) {
 		case MDOC_Aq:
 			enc_macro.before = "";
 			enc_macro.after = "";
@@ -211,36 +720,38 @@ deroff_print(const struct roff_node *n)
 			break;
 	}
 
-	ntype = n->type;
+	ntype = doc->type[n];
 	if (ntype != ROFFT_TEXT) {
 		if (ntype == ROFFT_BLOCK || ntype == ROFFT_ELEM)
-			fputs(enc_macro.before, stdout);
+			ostring(enc_macro.before);
 
-		for (n = n->child; n != NULL; n = n->next)
-			deroff_print(n);
+		for (n = doc->child[n]; n != FLAT_NONE; n = doc->next[n])
+			deroff_print(doc, n);
 
 		if (ntype == ROFFT_BLOCK || ntype == ROFFT_ELEM)
-			fputs(enc_macro.after, stdout);
+			ostring(enc_macro.after);
 
 		return (int)MQUERYLEVEL_OK;
 	}
 
 	/* do not print trailing space before newline */
-	if (n->next == NULL && n->parent->next != NULL)
-		if (n->parent->next->tok == MDOC_Pp)
+	pnext = doc->next[parent];
+	if (doc->next[n] == FLAT_NONE && pnext != FLAT_NONE)
+		if (doc->tok[pnext] == MDOC_Pp)
 			enc_text.after = "";
 	/* print link's description in parentheses */
-	if (n->parent->tok == MDOC_Lk && n->prev != NULL) {
+	if (doc->tok[parent] == MDOC_Lk && doc->child[parent] != n) {
 		enc_text.before = " (";
 		enc_text.after = ")";
 	}
 	/* handle display blocks */
-	if (n->flags & NODE_NOFILL)
+	if (flags & NODE_NOFILL)
 		enc_text.after = "\n";
 
-	fputs(enc_text.before, stdout);
-	pstring(n->string, n->flags);
-	fputs(enc_text.after, stdout);
+	ostring(enc_text.before);
+	if (doc->text[n] != FLAT_NONE)
+		pstring(doc->pool + doc->text[n], flags);
+	ostring(enc_text.after);
 
 	return (int)MQUERYLEVEL_OK;
 }
@@ -251,32 +762,40 @@ deroff_print(const struct roff_node *n)
  * This function is not recursive.
  */
 int
-print_item_heads(struct roff_node *n, enum roff_tok macro, int errflag)
+print_item_heads(const struct flatdoc *doc, uint32_t n, enum roff_tok macro,
+		int errflag)
 {
-	const struct roff_node *element;
-	int			found = 0;
+	uint32_t	element, head;
+	int		found = 0;
 
-	assert(n);
-	for (n = n->child; n != NULL; n = n->next) {
-		if (n->tok != MDOC_It)
+	assert(n != FLAT_NONE);
+	for (n = doc->child[n]; n != FLAT_NONE; n = doc->next[n]) {
+		if (doc->tok[n] != MDOC_It)
 			continue; /* mandoc -Tlint will give a warning */
 
-		element = n->head->child;
-		if (element == NULL) {
-			warnx("%d:%d: empty item header", n->line, n->pos);
+		head = flat_head(doc, n);
+		element = head == FLAT_NONE ? FLAT_NONE : doc->child[head];
+		if (element == FLAT_NONE) {
+			warnx("%d:%d: empty item header", doc->line[n], doc->pos[n]);
 			continue;
 		}
 
-		if (element->tok != macro)
+		if (doc->tok[element] != macro)
 			continue;
 
 		found = 1;
-		deroff_print(element);
-		puts("");
+		if (icollect != NULL) {
+			item_add(doc, element);
+			continue;
+		}
+		deroff_print(doc, element);
+		ochar('\n');
 	}
 
-	if (!found && errflag)
-		errx((int)MQUERYLEVEL_NOTFOUND, "no matching items found");
+	if (!found && errflag) {
+		warnx("no matching items found");
+		return (int)MQUERYLEVEL_NOTFOUND;
+	}
 	return (int)MQUERYLEVEL_OK;
 }
 
@@ -286,231 +805,2102 @@ print_item_heads(struct roff_node *n, enum roff_tok macro, int errflag)
  * This function is not recursive.
  */
 int
-print_item_bodies(struct roff_node *n, enum roff_tok macro,
+print_item_bodies(const struct flatdoc *doc, uint32_t n, enum roff_tok macro,
 		const char prepend_text[], int errflag)
 {
-	const struct roff_node *element;
-	int			found = 0;
+	uint32_t	element, body;
+	int		found = 0;
 
-	assert(n);
-	for (n = n->child; n != NULL; n = n->next) {
-		if (n->tok != MDOC_It)
+	assert(n != FLAT_NONE);
+	for (n = doc->child[n]; n != FLAT_NONE; n = doc->next[n]) {
+		if (doc->tok[n] != MDOC_It)
 			continue; /* mandoc -Tlint will give a warning */
 
-		element = n->body->child;
-		if (element == NULL) {
-			warnx("%d:%d: empty item body", n->line, n->pos);
+		body = flat_body(doc, n);
+		element = body == FLAT_NONE ? FLAT_NONE : doc->child[body];
+		if (element == FLAT_NONE) {
+			warnx("%d:%d: empty item body", doc->line[n], doc->pos[n]);
 			continue;
 		}
 
-		if (element->tok != macro)
+		if (doc->tok[element] != macro)
 			continue;
 
 		/*
 		 * special case for links - skip links without text
 		 */
-		if (element->tok == MDOC_Lk && element->child->next == NULL)
+		if (doc->tok[element] == MDOC_Lk &&
+		    (doc->child[element] == FLAT_NONE ||
+		     doc->next[doc->child[element]] == FLAT_NONE))
 			continue;
 
 		if (!found) {
-			printf("%s", prepend_text);
+			ostring(prepend_text);
 			found = 1;
 		}
 
-		deroff_print(element);
-		puts("");
+		deroff_print(doc, element);
+		ochar('\n');
 	}
 
-	if (!found && errflag)
-		errx((int)MQUERYLEVEL_NOTFOUND, "no matching items found");
+	if (!found && errflag) {
+		warnx("no matching items found");
+		return (int)MQUERYLEVEL_NOTFOUND;
+	}
 	return (int)MQUERYLEVEL_OK;
 }
 
-int
-global_query(struct roff_node *mdoc, char opt)
-{
-	struct roff_node	*nfound, *nvars;
+/*
+ * Sections and subsections -S reports on, bit 0 first.
+ */
+static const char *const known_sections[] = {
+	"NAME", "DESCRIPTION", "FUNCTIONS", "ECLASS VARIABLES",
+	"Required variables", "Optional variables", "Output variables",
+	"User variables", "DEPRECATED", "EXAMPLES", "AUTHORS", "MAINTAINERS",
+	"REPORTING BUGS", "SEE ALSO"
+};
 
+/*
+ * The section global_query() fails without.
+ */
+static const char *
+query_section(char opt)
+{
 	switch (opt) {
-	/* blurb */
 	case 'B':
-		nfound = first_node_by_name(mdoc, "NAME", 1);
-		nfound = first_node_by_macro(nfound->body, MDOC_Nd, 1);
-		return deroff_print(nfound);
-	/* description */
+		return "NAME";
 	case 'D':
-		nfound = first_node_by_name(mdoc, "DESCRIPTION", 1);
-		deroff_print(nfound->body);
-
-		nfound = first_node_by_name(mdoc, "SEE ALSO", 0);
-		if (nfound != NULL) {
-			nfound = first_node_by_macro(nfound->body, MDOC_Bl, 1);
-			return print_item_bodies(nfound->body, MDOC_Lk,
-						 "\n\nReferences:\n", 0);
-		}
-		return (int)MQUERYLEVEL_OK;
-	/* function list */
+		return "DESCRIPTION";
 	case 'F':
-		nfound = first_node_by_name(mdoc, "FUNCTIONS", 1);
-		nfound = first_node_by_macro(nfound->body, MDOC_Bl, 1);
-		return print_item_heads(nfound->body, MDOC_Ic, 1);
-	/* eclass variable list */
+		return "FUNCTIONS";
 	case 'V':
-		nvars = first_node_by_name(mdoc, "ECLASS VARIABLES", 1);
-		for (int i = 0; i < VAR_SUB_COUNT; ++i) {
-			nfound = first_node_by_name(mdoc, var_subsections[i], 0);
-			if (nfound == NULL)
-				continue;
-
-			nfound = first_node_by_macro(nfound->body, MDOC_Bl, 1);
-			print_item_heads(nfound->body, MDOC_Dv, 0);
-			print_item_heads(nfound->body, MDOC_Ev, 0);
-			print_item_heads(nfound->body, MDOC_Va, 0);
-		}
-		return (int)MQUERYLEVEL_OK;
-	/* authors */
+		return "ECLASS VARIABLES";
 	case 'a':
-		nfound = first_node_by_name(mdoc, "AUTHORS", 1);
-		return deroff_print(nfound->body);
-	/* reporting bugs */
+		return "AUTHORS";
 	case 'b':
-		nfound = first_node_by_name(mdoc, "REPORTING BUGS", 1);
-		nfound = first_node_by_macro(nfound->body, MDOC_Lk, 1);
-		return deroff_print(nfound->child);
-	/* deprecation check */
+		return "REPORTING BUGS";
 	case 'd':
-		nfound = first_node_by_name(mdoc, "DEPRECATED", 1);
-		return deroff_print(nfound->body);
-	/* examples */
+		return "DEPRECATED";
 	case 'e':
-		nfound = first_node_by_name(mdoc, "EXAMPLES", 1);
-		return deroff_print(nfound->body);
-	/* maintainers */
+		return "EXAMPLES";
 	case 'm':
-		nfound = first_node_by_name(mdoc, "MAINTAINERS", 1);
-		return deroff_print(nfound->body);
+		return "MAINTAINERS";
 	default:
-		errx((int)MQUERYLEVEL_UNSUPP, "option is not implemented");
+		return NULL;
 	}
 }
 
-int
-function_query(struct roff_node *mdoc, const char *funcname, char opt)
+/*
+ * Map an uncompressed regular file for reading, or return NULL.
+ */
+static const char *
+map_raw(int fd, size_t *lenp)
 {
-	switch (opt) {
-	default:
-		errx((int)MQUERYLEVEL_UNSUPP, "option is not implemented");
+	struct stat	 st;
+	char		*buf;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < 2)
+		return NULL;
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+	/* gzipped pages are left to mparse_readfd() */
+	if ((unsigned char)buf[0] == 0x1f && (unsigned char)buf[1] == 0x8b) {
+		munmap(buf, st.st_size);
+		return NULL;
 	}
+
+	*lenp = st.st_size;
+	return buf;
 }
 
-int
-variable_query(struct roff_node *mdoc, const char *varname, char opt)
+/*
+ * Whether pages may be cut down before parsing, see slice_page().
+ */
+static int
+use_slices(void)
 {
-	switch (opt) {
-	default:
-		errx((int)MQUERYLEVEL_UNSUPP, "option is not implemented");
-	}
+	const char	*env;
+
+	env = getenv("MQUERY_NO_SLICE");
+	return env == NULL || *env == '\0';
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * Cut the page down to the prologue, the first section and the
+ * section starting at offset target.  Skipped lines become comments
+ * so that line numbers stay the same.  Returns NULL if the skipped
+ * lines may set roff state that the kept ones use.
+ */
+static const char *
+slice_page(const char *raw, size_t len, size_t target, size_t *slicelen)
 {
-	struct roff_meta       *meta;
-	struct mparse	       *mp;
-	const char	       *fnin = NULL, *itemname = NULL, *optstring;
-	int			functionq, variableq, flagc, fd, exit_status;
-	char			ch, flag = '\0';
+	const char	*p, *end;
+	char		*slice, *q;
+	size_t		 sh1, sh2, tend, npad;
 
-	functionq = 0;
-	variableq = 0;
-	optstring = "BDFVabdem";
-	if (strcasecmp(program_invocation_short_name, "mquery-function") == 0) {
-		functionq = 1;
-		optstring = "DdiruF:";
-	}
-	if (strcasecmp(program_invocation_short_name, "mquery-variable") == 0) {
-		variableq = 1;
-		optstring = "DdiopruV:";
+	sh1 = scan_next_sh(raw, len, 0);
+	sh2 = scan_next_sh(raw, len, sh1 + 1);
+	tend = scan_next_sh(raw, len, target + 1);
+
+	if (target <= sh2) {
+		*slicelen = tend;
+		return raw;
 	}
+	if (scan_sets_state(raw, sh2, target))
+		return NULL;
 
-	flagc = 0;
-	while ((ch = getopt(argc, argv, optstring)) != -1) {
-		switch (ch) {
-		case 'B':
-		case 'D':
-		case 'a':
-		case 'b':
-		case 'd':
-		case 'i':
-		case 'e':
-		case 'm':
-		case 'o':
-		case 'p':
-		case 'r':
-		case 'u':
-			flag = ch;
-			++flagc;
-			break;
-		case 'F':
-		case 'V':
-			if (functionq || variableq)
-				itemname = optarg;
-			else {
-				flag = ch;
-				++flagc;
-			}
-			break;
-		default:
-			goto usage;
+	npad = 0;
+	end = raw + target;
+	for (p = raw + sh2; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		npad++;
+
+	*slicelen = sh2 + npad * 4 + (tend - target);
+	q = slice = arena_alloc(&doc_arena, *slicelen);
+	memcpy(q, raw, sh2);
+	for (q += sh2; npad > 0; npad--, q += 4)
+		memcpy(q, ".\\\"\n", 4);
+	memcpy(q, raw + target, tend - target);
+	return slice;
+}
+
+/*
+ * Parse a document that is already in memory.
+ */
+static int
+parse_mem(struct mparse *mp, const char *buf, size_t len, const char *fn)
+{
+	size_t	 off;
+	ssize_t	 nw;
+	int	 fd;
+
+	if ((fd = memfd_create("mquery", MFD_CLOEXEC)) == -1)
+		return -1;
+	for (off = 0; off < len; off += nw)
+		if ((nw = write(fd, buf + off, len - off)) <= 0) {
+			close(fd);
+			return -1;
 		}
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
 	}
 
-	argc -= optind;
-	argv += optind;
+	mparse_readfd(mp, fd, fn);
+	close(fd);
+	return 0;
+}
 
-	if (argc != 1 || flagc != 1)
-		goto usage;
-	if (itemname == NULL && (functionq || variableq))
-		goto usage;
+/*
+ * Parse the page in raw a global query opt is run on.  If the raw text
+ * shows that the section the query needs cannot exist, return
+ * MQUERYLEVEL_NOTFOUND without parsing.  Queries that only look at
+ * their own section get a sliced page (-D also needs SEE ALSO and
+ * -V searches subsections by name across the page).  Whole pages are
+ * read from fd unless it is -1.
+ */
+static int
+parse_raw(struct mparse *mp, const char *raw, size_t len, int fd,
+		const char *fn, char opt)
+{
+	struct scan_hit	 hit;
+	const char	*section, *slice;
+	size_t		 slicelen;
+	enum scan_res	 res;
+
+	res = SCAN_UNSURE;
+	if ((section = query_section(opt)) != NULL)
+		res = scan_head(raw, len, section, &hit);
+
+	if (res == SCAN_ABSENT)
+		return (int)MQUERYLEVEL_NOTFOUND;
+
+	if (res == SCAN_FOUND && opt != 'D' && opt != 'V' &&
+	    hit.tok == MDOC_Sh && hit.exact && use_slices() &&
+	    (slice = slice_page(raw, len, hit.offset, &slicelen)) != NULL &&
+	    parse_mem(mp, slice, slicelen, fn) == 0)
+		return (int)MQUERYLEVEL_OK;
 
-	mchars_alloc();
-	mp = mparse_alloc(MPARSE_MDOC | MPARSE_VALIDATE | MPARSE_UTF8,
-			  MANDOC_OS_OTHER, NULL);
-	assert(mp);
+	if (fd != -1)
+		mparse_readfd(mp, fd, fn);
+	else if (parse_mem(mp, raw, len, fn) == -1) {
+		warn("%s", fn);
+		return (int)MQUERYLEVEL_SYSERR;
+	}
+	return (int)MQUERYLEVEL_OK;
+}
 
-	fnin = argv[0];
-	if ((fd = mparse_open(mp, fnin)) == -1)
-		err((int)MQUERYLEVEL_BADARG, "%s", fnin);
-	mparse_readfd(mp, fd, fnin);
-	close(fd);
-	meta = mparse_result(mp);
+/*
+ * Parse the open page fd for a global query opt, see parse_raw().
+ */
+static int
+parse_page(struct mparse *mp, int fd, const char *fn, char opt)
+{
+	const char	*raw;
+	size_t		 rawlen;
+	int		 status;
+
+	if (query_section(opt) == NULL ||
+	    (raw = map_raw(fd, &rawlen)) == NULL) {
+		mparse_readfd(mp, fd, fn);
+		return (int)MQUERYLEVEL_OK;
+	}
 
-	if (meta == NULL)
-		errx((int)MQUERYLEVEL_ERROR, "could not parse %s", fnin);
-	if (meta->macroset != MACROSET_MDOC)
-		errx((int)MQUERYLEVEL_ERROR, "not an mdoc document: %s", fnin);
+	status = parse_raw(mp, raw, rawlen, fd, fn, opt);
+	munmap((void *)raw, rawlen);
+	return status;
+}
 
-	if (functionq)
-		exit_status = function_query(meta->first->child, itemname, flag);
-	if (variableq)
-		exit_status = variable_query(meta->first->child, itemname, flag);
-	exit_status = global_query(meta->first->child, flag);
+/*
+ * Tell which of known_sections[] the page in buf, or in fd unless it
+ * is -1, has without parsing it.  This only works if the scanner is
+ * sure of every name: no line can produce the head, or the first one
+ * that may is a .Sh or .Ss line deroffing to exactly the name.
+ * Return -1 if the page has to be parsed.
+ */
+static int
+sections_raw(int fd, const char *buf, size_t len, unsigned int *maskp)
+{
+	struct scan_hit	 hit;
+	const char	*raw;
+	size_t		 i, rawlen;
+	enum scan_res	 res;
+	int		 rc;
+
+	raw = buf;
+	rawlen = len;
+	if (fd != -1 && (raw = map_raw(fd, &rawlen)) == NULL)
+		return -1;
+
+	*maskp = 0;
+	rc = 0;
+	for (i = 0; i < sizeof(known_sections) / sizeof(known_sections[0]);
+	    i++) {
+		res = scan_head(raw, rawlen, known_sections[i], &hit);
+		if (res == SCAN_ABSENT)
+			continue;
+		if (res == SCAN_FOUND && hit.exact &&
+		    (hit.tok == MDOC_Sh || hit.tok == MDOC_Ss)) {
+			*maskp |= 1U << i;
+			continue;
+		}
+		rc = -1;
+		break;
+	}
+
+	if (fd != -1)
+		munmap((void *)raw, rawlen);
+	return rc;
+}
+
+static int
+sections_print(unsigned int mask)
+{
+	char	buf[16];
+
+	snprintf(buf, sizeof(buf), "%04x", mask);
+	if (oformat == OUTPUT_BINARY)
+		orecord('S', "", "", buf, 0, 0);
+	else if (oformat == OUTPUT_SHELL) {
+		odeclare('S');
+		oquote(buf, strlen(buf));
+	} else
+		ostring(buf);
+	if (oformat != OUTPUT_BINARY)
+		ochar('\n');
+	return (int)MQUERYLEVEL_OK;
+}
+
+/*
+ * Emit a tag of the eclass documentation block.  Inline tags get the
+ * first line of text after the tag, the others get all of it on
+ * comment lines of their own, without trailing blanks and with runs
+ * of empty lines squeezed.
+ */
+static void
+header_tag(const char *tag, const char *text, int isinline)
+{
+	const char	*line, *end, *next;
+	int		 blank;
+
+	ostring("# @");
+	ostring(tag);
+	ostring(":");
+	text += strspn(text, " \t\n");
+	if (isinline) {
+		end = text + strcspn(text, "\n");
+		while (end > text && (end[-1] == ' ' || end[-1] == '\t'))
+			end--;
+		if (end > text)
+			ochar(' ');
+		owrite(text, end - text);
+		ochar('\n');
+		return;
+	}
+	ochar('\n');
+
+	blank = 0;
+	for (line = text; *line != '\0'; line = next) {
+		end = line + strcspn(line, "\n");
+		next = *end == '\0' ? end : end + 1;
+		while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+			end--;
+		if (end == line) {
+			blank = 1;
+			continue;
+		}
+		if (blank)
+			ostring("#\n");
+		blank = 0;
+		ostring("# ");
+		owrite(line, end - line);
+		ochar('\n');
+	}
+}
+
+/*
+ * The whole top-level eclass documentation block, tags in the order
+ * of the eclass documentation format.  NAME and MAINTAINERS are
+ * required, other sections are left out if the page lacks them.
+ * Sections are looked up in the index, so the tree is walked once
+ * for the index and then only within the sections the tags use.
+ */
+static int
+header_query(const struct flatdoc *doc, const struct sectindex *si)
+{
+	static const struct {
+		const char	*tag;
+		char		 opt;
+		int		 isinline;
+		int		 required;
+	} tags[] = {
+		{ "MAINTAINER",	'm', 0, 1 },
+		{ "AUTHOR",	'a', 0, 0 },
+		{ "BUGREPORTS",	'b', 0, 0 },
+		{ "BLURB",	'B', 1, 1 },
+		{ "DEPRECATED",	'd', 1, 0 },
+		{ "DESCRIPTION", 'D', 0, 0 },
+		{ "EXAMPLE",	'e', 0, 0 },
+	};
+	uint32_t	 n;
+	char		*text;
+	size_t		 i;
+	int		 exit_status, status;
+
+	exit_status = (int)MQUERYLEVEL_OK;
+	if ((n = section_find(doc, si, "NAME", 0)) != FLAT_NONE &&
+	    (n = first_node_by_macro(doc, flat_body(doc, n), MDOC_Nm,
+	    0)) != FLAT_NONE && doc->child[n] != FLAT_NONE &&
+	    doc->text[doc->child[n]] != FLAT_NONE) {
+		ostring("# @ECLASS: ");
+		ostring(doc->pool + doc->text[doc->child[n]]);
+		ochar('\n');
+	}
+
+	for (i = 0; i < sizeof(tags) / sizeof(tags[0]); i++) {
+		if (!tags[i].required && section_find(doc, si,
+		    query_section(tags[i].opt), 0) == FLAT_NONE)
+			continue;
+		status = capture_query(doc, si, tags[i].opt, &text);
+		/* a deprecated eclass without a replacement */
+		if (status == MQUERYLEVEL_OK && tags[i].opt == 'd' &&
+		    text[strspn(text, " \t\n")] == '\0')
+			header_tag(tags[i].tag, "none", 1);
+		else if (status == MQUERYLEVEL_OK)
+			header_tag(tags[i].tag, text, tags[i].isinline);
+		else if (status > exit_status)
+			exit_status = status;
+	}
+	return exit_status;
+}
+
+/*
+ * Emit the documentation block of one list item: the tag with the
+ * item name, then extra lines, or @USAGE from the rest of the head if
+ * extra is NULL, and the deroffed body as @DESCRIPTION.  Items are
+ * separated by empty lines, or each make a record of subsection sub
+ * for -T binary and an element of the array for -T shell.
+ */
+static int
+item_block(const struct flatdoc *doc, uint32_t it, const char *tag,
+		const char *extra, const char *sub, int *nump)
+{
+	struct capture	 blk, c;
+	uint32_t	 head, body, element, n;
+	char		*name, *text;
+	size_t		 len;
+	int		 rec;
+
+	head = flat_head(doc, it);
+	element = head == FLAT_NONE ? FLAT_NONE : doc->child[head];
+	if (element == FLAT_NONE) {
+		warnx("%d:%d: empty item header", doc->line[it], doc->pos[it]);
+		return 0;
+	}
+
+	/* records and array elements get the block on its own */
+	if ((rec = oformat != OUTPUT_TEXT))
+		capture_start(&blk);
+	else if ((*nump)++ > 0)
+		ochar('\n');
+	capture_start(&c);
+	deroff_print(doc, element);
+	name = capture_end(&c);
+	header_tag(tag, name, 1);
+
+	/* the rest of a function's head are its arguments */
+	if (extra == NULL && doc->next[element] != FLAT_NONE) {
+		capture_start(&c);
+		for (n = doc->next[element]; n != FLAT_NONE; n = doc->next[n])
+			deroff_print(doc, n);
+		text = capture_end(&c);
+		if (text[strspn(text, " \t\n")] != '\0')
+			header_tag("USAGE", text, 1);
+	} else if (extra != NULL)
+		ostring(extra);
+
+	if ((body = flat_body(doc, it)) != FLAT_NONE &&
+	    doc->child[body] != FLAT_NONE) {
+		capture_start(&c);
+		deroff_print(doc, body);
+		text = capture_end(&c);
+		header_tag("DESCRIPTION", text, 0);
+	}
+
+	if (rec && oformat == OUTPUT_BINARY) {
+		text = capture_end(&blk);
+		for (len = strlen(name); len > 0 &&
+		     isspace((unsigned char)name[len - 1]); len--)
+			continue;
+		name[len] = '\0';
+		orecord('I', name + strspn(name, " \t\n"), sub, text,
+		    doc->line[element], doc->pos[element]);
+	} else if (rec) {
+		text = capture_end(&blk);
+		ostring(" [");
+		oquote(name, strlen(name));
+		ostring("]=");
+		oquote(text, strlen(text));
+	}
+	return 1;
+}
+
+/*
+ * The documentation blocks of all functions and eclass variables,
+ * from one walk over each list.
+ */
+static int
+items_query(const struct flatdoc *doc, const struct sectindex *si)
+{
+	static const struct {
+		const char	*tag;
+		const char	*extra;
+	} vartags[VAR_SUB_COUNT] = {
+		{ "ECLASS_VARIABLE", "# @REQUIRED\n" },
+		{ "ECLASS_VARIABLE", "" },
+		{ "OUTPUT_VARIABLE", "" },
+		{ "USER_VARIABLE", "" },
+	};
+	uint32_t	 n, bl;
+	int		 i, found, num;
+
+	found = num = 0;
+	if ((n = section_find(doc, si, "FUNCTIONS", 0)) != FLAT_NONE &&
+	    (bl = first_node_by_macro(doc, flat_body(doc, n), MDOC_Bl,
+	    0)) != FLAT_NONE && (bl = flat_body(doc, bl)) != FLAT_NONE)
+		for (n = doc->child[bl]; n != FLAT_NONE; n = doc->next[n])
+			if (doc->tok[n] == MDOC_It)
+				found |= item_block(doc, n, "FUNCTION", NULL,
+				    "", &num);
+
+	for (i = 0; i < VAR_SUB_COUNT; i++) {
+		if ((n = section_find(doc, si, var_subsections[i], 0)) ==
+		    FLAT_NONE ||
+		    (bl = first_node_by_macro(doc, flat_body(doc, n), MDOC_Bl,
+		    0)) == FLAT_NONE || (bl = flat_body(doc, bl)) == FLAT_NONE)
+			continue;
+		for (n = doc->child[bl]; n != FLAT_NONE; n = doc->next[n])
+			if (doc->tok[n] == MDOC_It)
+				found |= item_block(doc, n, vartags[i].tag,
+				    vartags[i].extra, var_subsections[i],
+				    &num);
+	}
+
+	if (!found) {
+		warnx("no documented functions or variables");
+		return (int)MQUERYLEVEL_NOTFOUND;
+	}
+	return (int)MQUERYLEVEL_OK;
+}
+
+/*
+ * The function list for 'F', the eclass variable list for 'V'.
+ */
+static int
+item_list(const struct flatdoc *doc, const struct sectindex *si, char opt)
+{
+	uint32_t	nfound;
+
+	/* function list */
+	if (opt == 'F') {
+		if ((nfound = section_find(doc, si, "FUNCTIONS", 1)) ==
+		    FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		if ((nfound = first_node_by_macro(doc, flat_body(doc, nfound),
+		    MDOC_Bl, 1)) == FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return print_item_heads(doc, flat_body(doc, nfound),
+					MDOC_Ic, 1);
+	}
+
+	/* eclass variable list */
+	if (section_find(doc, si, "ECLASS VARIABLES", 1) == FLAT_NONE)
+		return (int)MQUERYLEVEL_NOTFOUND;
+	for (int i = 0; i < VAR_SUB_COUNT; ++i) {
+		nfound = section_find(doc, si, var_subsections[i], 0);
+		if (nfound == FLAT_NONE)
+			continue;
+		if (icollect != NULL)
+			icollect->sub = var_subsections[i];
+
+		if ((nfound = first_node_by_macro(doc,
+		    flat_body(doc, nfound), MDOC_Bl, 1)) == FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		nfound = flat_body(doc, nfound);
+		print_item_heads(doc, nfound, MDOC_Dv, 0);
+		print_item_heads(doc, nfound, MDOC_Ev, 0);
+		print_item_heads(doc, nfound, MDOC_Va, 0);
+	}
+	return (int)MQUERYLEVEL_OK;
+}
+
+static int
+item_cmp(const void *a, const void *b)
+{
+	const struct item	*ia = a, *ib = b;
+	int			 c;
+
+	c = memcmp(ia->name, ib->name, ia->len < ib->len ? ia->len : ib->len);
+	return c != 0 ? c : (ia->len > ib->len) - (ia->len < ib->len);
+}
+
+/*
+ * An item list with -x, -s, -u and -0 applied, or laid out for -T
+ * binary or -T shell.  Items are compared without trailing blanks
+ * but printed as they are.
+ */
+static int
+filter_items(const struct flatdoc *doc, const struct sectindex *si, char opt)
+{
+	struct itemvec	 iv;
+	struct item	*v;
+	size_t		 i, j, vc;
+	char		 save;
+	int		 status;
+
+	memset(&iv, 0, sizeof(iv));
+	iv.sub = "";
+	icollect = &iv;
+	status = item_list(doc, si, opt);
+	icollect = NULL;
+
+	v = iv.v;
+	for (i = vc = 0; i < iv.c; i++) {
+		if (itemopts.filter) {
+			save = v[i].name[v[i].len];
+			v[i].name[v[i].len] = '\0';
+			if (regexec(&itemopts.re, v[i].name, 0, NULL, 0) != 0)
+				continue;
+			v[i].name[v[i].len] = save;
+		}
+		v[vc++] = v[i];
+	}
+
+	if (itemopts.sort)
+		qsort(v, vc, sizeof(*v), item_cmp);
+	for (i = 0; i < vc; i++) {
+		if (itemopts.unique) {
+			/* sorted lists only need a look back */
+			for (j = itemopts.sort ? (i > 0 ? i - 1 : 0) : 0;
+			     j < i; j++)
+				if (item_cmp(&v[i], &v[j]) == 0)
+					break;
+			if (j < i)
+				continue;
+		}
+		if (oformat == OUTPUT_BINARY) {
+			save = v[i].name[v[i].len];
+			v[i].name[v[i].len] = '\0';
+			orecord(opt, v[i].name, v[i].sub, "",
+			    doc->line[v[i].node], doc->pos[v[i].node]);
+			v[i].name[v[i].len] = save;
+		} else if (oformat == OUTPUT_SHELL) {
+			ostring(opt == 'V' ? " [" : " ");
+			oquote(v[i].name, v[i].len);
+			if (opt == 'V') {
+				ostring("]=");
+				oquote(v[i].sub, strlen(v[i].sub));
+			}
+		} else if (itemopts.nul)
+			onul(v[i].name, v[i].len);
+		else {
+			ostring(v[i].name);
+			ochar('\n');
+		}
+	}
+
+	if (status == MQUERYLEVEL_OK && vc == 0 && itemopts.filter) {
+		warnx("no matching items found");
+		return (int)MQUERYLEVEL_NOTFOUND;
+	}
+	return status;
+}
+
+/*
+ * Print every node the -q selector matches, in page order, one per
+ * line.
+ */
+static int
+selector_query(const struct flatdoc *doc)
+{
+	struct capture	 c;
+	uint8_t		*hits;
+	char		*text;
+	uint32_t	 n;
+	int		 found;
+
+	hits = arena_calloc(&doc_arena, doc->nodec, sizeof(*hits));
+	selector_match(qselector, doc, hits);
+	found = 0;
+	for (n = 0; n < doc->nodec; n++) {
+		if (!hits[n])
+			continue;
+		found = 1;
+		if (oformat != OUTPUT_TEXT || itemopts.nul) {
+			capture_start(&c);
+			deroff_print(doc, n);
+			text = capture_end(&c);
+			if (oformat == OUTPUT_BINARY)
+				orecord('q', "", "", text, doc->line[n],
+				    doc->pos[n]);
+			else if (itemopts.nul)
+				onul(text, strlen(text));
+			else {
+				ochar(' ');
+				oquote(text, strlen(text));
+			}
+			continue;
+		}
+		deroff_print(doc, n);
+		ochar('\n');
+	}
+
+	if (!found) {
+		warnx("nothing matches the selector");
+		return (int)MQUERYLEVEL_NOTFOUND;
+	}
+	return (int)MQUERYLEVEL_OK;
+}
+
+/*
+ * Print which of known_sections[] the page has, see sections_raw().
+ */
+static int
+sections_query(const struct flatdoc *doc, const struct sectindex *si)
+{
+	unsigned int	mask;
+	size_t		i;
+
+	mask = 0;
+	for (i = 0; i < sizeof(known_sections) / sizeof(known_sections[0]);
+	    i++)
+		if (section_find(doc, si, known_sections[i], 0) != FLAT_NONE)
+			mask |= 1U << i;
+	return sections_print(mask);
+}
+
+int
+global_query(const struct flatdoc *doc, const struct sectindex *si, char opt)
+{
+	uint32_t	nfound;
+
+	switch (opt) {
+	/* blurb */
+	case 'B':
+		if ((nfound = section_find(doc, si, "NAME", 1)) == FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		if ((nfound = first_node_by_macro(doc, flat_body(doc, nfound),
+		    MDOC_Nd, 1)) == FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return deroff_print(doc, nfound);
+	/* description */
+	case 'D':
+		if ((nfound = section_find(doc, si, "DESCRIPTION", 1)) ==
+		    FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		deroff_print(doc, flat_body(doc, nfound));
+
+		nfound = section_find(doc, si, "SEE ALSO", 0);
+		if (nfound != FLAT_NONE) {
+			if ((nfound = first_node_by_macro(doc,
+			    flat_body(doc, nfound), MDOC_Bl, 1)) == FLAT_NONE)
+				return (int)MQUERYLEVEL_NOTFOUND;
+			return print_item_bodies(doc, flat_body(doc, nfound),
+						 MDOC_Lk, "\n\nReferences:\n", 0);
+		}
+		return (int)MQUERYLEVEL_OK;
+	/* function and eclass variable lists */
+	case 'F':
+	case 'V':
+		if (itemopts.filter || itemopts.sort || itemopts.unique ||
+		    itemopts.nul || oformat != OUTPUT_TEXT)
+			return filter_items(doc, si, opt);
+		return item_list(doc, si, opt);
+	/* authors */
+	case 'a':
+		if ((nfound = section_find(doc, si, "AUTHORS", 1)) == FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return deroff_print(doc, flat_body(doc, nfound));
+	/* reporting bugs */
+	case 'b':
+		if ((nfound = section_find(doc, si, "REPORTING BUGS", 1)) ==
+		    FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		if ((nfound = first_node_by_macro(doc, flat_body(doc, nfound),
+		    MDOC_Lk, 1)) == FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return deroff_print(doc, doc->child[nfound]);
+	/* deprecation check */
+	case 'd':
+		if ((nfound = section_find(doc, si, "DEPRECATED", 1)) ==
+		    FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return deroff_print(doc, flat_body(doc, nfound));
+	/* examples */
+	case 'e':
+		if ((nfound = section_find(doc, si, "EXAMPLES", 1)) ==
+		    FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return deroff_print(doc, flat_body(doc, nfound));
+	/* the whole documentation block */
+	case 'H':
+		return header_query(doc, si);
+	/* documentation blocks of all items */
+	case 'I':
+		return items_query(doc, si);
+	/* known sections */
+	case 'S':
+		return sections_query(doc, si);
+	/* selector */
+	case 'q':
+		return selector_query(doc);
+	/* maintainers */
+	case 'm':
+		if ((nfound = section_find(doc, si, "MAINTAINERS", 1)) ==
+		    FLAT_NONE)
+			return (int)MQUERYLEVEL_NOTFOUND;
+		return deroff_print(doc, flat_body(doc, nfound));
+	default:
+		errx((int)MQUERYLEVEL_UNSUPP, "option is not implemented");
+	}
+}
+
+/*
+ * Run several global queries on a page whose sections were indexed
+ * once.  The output of each is collected on its own and emitted in
+ * the order they were given, after a "-- -X --" line.
+ */
+static int
+multi_query(const struct flatdoc *doc, const struct sectindex *si,
+		const char *flags)
+{
+	char	*text[sizeof(((struct query *)NULL)->flags)];
+	size_t	 i, len, flagc;
+	int	 exit_status, status;
+
+	exit_status = (int)MQUERYLEVEL_OK;
+	flagc = strlen(flags);
+	for (i = 0; i < flagc; i++) {
+		status = capture_query(doc, si, flags[i], &text[i]);
+		if (status > exit_status)
+			exit_status = status;
+	}
+
+	for (i = 0; i < flagc; i++) {
+		ostring("-- -");
+		ochar(flags[i]);
+		ostring(" --\n");
+		len = strlen(text[i]);
+		owrite(text[i], len);
+		if (len > 0 && text[i][len - 1] != '\n')
+			ochar('\n');
+	}
+	return exit_status;
+}
+
+/*
+ * Declare the variable of opt for -T shell from the output of its
+ * query: an array of the non-blank lines for -a and -m, else a string.
+ * A string the query failed to find is unset instead, so that nothing
+ * is left over from an earlier page.
+ */
+static void
+shell_value(char opt, const char *text, int status)
+{
+	const struct shellvar	*sv;
+	const char		*end;
+
+	sv = shellvar(opt);
+	if (sv->decl[1] == '-' && status != MQUERYLEVEL_OK &&
+	    *text == '\0') {
+		ostring("unset -v ");
+		ostring(sv->name);
+		ochar('\n');
+		return;
+	}
+
+	odeclare(opt);
+	if (sv->decl[1] == '-') {
+		oquote(text, strlen(text));
+		ochar('\n');
+		return;
+	}
+	for (; *text != '\0'; text = end + (*end == '\n')) {
+		end = text + strcspn(text, "\n");
+		if (text + strspn(text, " \t") == end)
+			continue;
+		ochar(' ');
+		oquote(text, end - text);
+	}
+	ostring(" )\n");
+}
+
+/*
+ * Run global queries for -T binary and -T shell.  List queries emit a
+ * record or an array element for each item, the others one record
+ * with all of their output and the position of their section, or one
+ * variable.
+ */
+static int
+record_query(const struct flatdoc *doc, const struct sectindex *si,
+		const char *flags)
+{
+	const char	*section;
+	char		*text;
+	uint32_t	 n;
+	int		 exit_status, status;
+
+	exit_status = (int)MQUERYLEVEL_OK;
+	for (; *flags != '\0'; flags++) {
+		switch (*flags) {
+		case 'F':
+		case 'I':
+		case 'V':
+		case 'q':
+			if (oformat == OUTPUT_SHELL)
+				odeclare(*flags);
+			status = global_query(doc, si, *flags);
+			if (oformat == OUTPUT_SHELL)
+				ostring(" )\n");
+			break;
+		case 'S':
+			status = global_query(doc, si, *flags);
+			break;
+		default:
+			status = capture_query(doc, si, *flags, &text);
+			if (oformat == OUTPUT_SHELL) {
+				shell_value(*flags, text, status);
+				break;
+			}
+			n = FLAT_NONE;
+			if ((section = query_section(*flags)) != NULL)
+				n = section_find(doc, si, section, 0);
+			if (status == MQUERYLEVEL_OK || *text != '\0')
+				orecord(*flags, "", "", text,
+				    n == FLAT_NONE ? 0 : doc->line[n],
+				    n == FLAT_NONE ? 0 : doc->pos[n]);
+			break;
+		}
+		if (status > exit_status)
+			exit_status = status;
+	}
+	return exit_status;
+}
+
+int
+function_query(const struct flatdoc *doc, uint32_t mdoc, const char *funcname,
+		char opt)
+{
+	switch (opt) {
+	default:
+		errx((int)MQUERYLEVEL_UNSUPP, "option is not implemented");
+	}
+}
+
+int
+variable_query(const struct flatdoc *doc, uint32_t mdoc, const char *varname,
+		char opt)
+{
+	switch (opt) {
+	default:
+		errx((int)MQUERYLEVEL_UNSUPP, "option is not implemented");
+	}
+}
+
+/*
+ * Parse one page into doc.  The page is read from fd, or taken from
+ * buf if fd is -1.  Pages for -O are always parsed whole.
+ */
+static int
+parse_doc(struct mparse *mp, const struct query *q, const char *fn,
+		int fd, const char *buf, size_t len, struct flatdoc *doc)
+{
+	struct roff_meta	*meta;
+	struct mstats		 ms;
+	int			 status;
+#ifdef HAVE_SYS_SDT_H
+	long long		 insize;
+
+	/* one fstat() for all probes of the page */
+	insize = probe_insize(fd, len);
+#endif
+
+	mstats_mark(&ms);
+	PROBE3(parse__start, fn, q->flag, insize);
+	status = (int)MQUERYLEVEL_OK;
+	if (!q->functionq && !q->variableq && q->outdir == NULL)
+		status = fd == -1 ?
+		    parse_raw(mp, buf, len, -1, fn, q->flag) :
+		    parse_page(mp, fd, fn, q->flag);
+	else if (fd != -1)
+		mparse_readfd(mp, fd, fn);
+	else if (parse_mem(mp, buf, len, fn) == -1) {
+		warn("%s", fn);
+		status = (int)MQUERYLEVEL_SYSERR;
+	}
+	PROBE4(parse__done, fn, q->flag, insize, status);
+	if (status == MQUERYLEVEL_NOTFOUND)
+		warnx("section not found: %s", query_section(q->flag));
+	if (status != MQUERYLEVEL_OK) {
+		mstats_report(fn, "parse", &ms);
+		return status;
+	}
+	PROBE3(result__start, fn, q->flag, insize);
+	meta = mparse_result(mp);
+	PROBE3(result__done, fn, q->flag, insize);
+	mstats_report(fn, "parse", &ms);
+
+	if (meta == NULL) {
+		warnx("could not parse %s", fn);
+		return (int)MQUERYLEVEL_ERROR;
+	}
+	if (meta->macroset != MACROSET_MDOC) {
+		warnx("not an mdoc document: %s", fn);
+		return (int)MQUERYLEVEL_ERROR;
+	}
+
+	/* the tree is not needed once flattened */
+	flat_build(doc, &doc_arena, meta->first);
+	mparse_reset(mp);
+	return (int)MQUERYLEVEL_OK;
+}
+
+/*
+ * Run the query on a parsed page.
+ */
+static int
+query_doc(const struct query *q, const char *fn, const struct flatdoc *doc)
+{
+	struct sectindex	si;
+	struct mstats		ms;
+	int			status;
+
+	mstats_mark(&ms);
+	PROBE3(query__start, fn, q->flag,
+	    q->itemname == NULL ? "" : q->itemname);
+	if (q->functionq)
+		status = function_query(doc, doc->child[0], q->itemname,
+					q->flag);
+	else if (q->variableq)
+		status = variable_query(doc, doc->child[0], q->itemname,
+					q->flag);
+	else {
+		section_index(doc, doc->child[0], &si);
+		if (oformat != OUTPUT_TEXT)
+			status = record_query(doc, &si, q->flags);
+		else if (q->flag == QUERY_MULTI)
+			status = multi_query(doc, &si, q->flags);
+		else
+			status = global_query(doc, &si, q->flag);
+	}
+	PROBE4(query__done, fn, q->flag, status, outbytes);
+	mstats_report(fn, "query", &ms);
+
+	PROBE3(flush__start, fn, q->flag, outbytes);
+	if (!obuffered && fflush(stdout) == EOF)
+		err((int)MQUERYLEVEL_SYSERR, "stdout");
+	PROBE3(flush__done, fn, q->flag, outbytes);
+	return status;
+}
+
+/*
+ * Forget everything about the last page.
+ */
+static void
+end_doc(struct mparse *mp, const char *fn)
+{
+	mparse_reset(mp);
+	arena_reset(&doc_arena);
+	mstats_rss(fn);
+}
+
+/*
+ * Parse one page and run the query on it, see parse_doc().
+ */
+static int
+run_query(struct mparse *mp, const struct query *q, const char *fn,
+		int fd, const char *buf, size_t len)
+{
+	struct flatdoc	doc;
+	unsigned int	mask;
+	int		status;
+
+	/* -S can often be answered from the raw text */
+	if (q->flag == 'S' && sections_raw(fd, buf, len, &mask) == 0) {
+		status = sections_print(mask);
+		if (!obuffered && fflush(stdout) == EOF)
+			err((int)MQUERYLEVEL_SYSERR, "stdout");
+		return status;
+	}
+
+	if ((status = parse_doc(mp, q, fn, fd, buf, len, &doc)) ==
+	    MQUERYLEVEL_OK)
+		status = query_doc(q, fn, &doc);
+	end_doc(mp, fn);
+	return status;
+}
+
+/*
+ * Run the query on a page in memory.  With a cache directory, the
+ * output and status are looked up under results/ by a hash of the
+ * page and the query, and stored there after a miss.  Diagnostics
+ * are not kept.
+ */
+static int
+query_page(struct mparse *mp, const struct query *q, const char *fn,
+		int fd, const char *buf, size_t len)
+{
+	struct cache_hash	 ch;
+	char			 key[CACHE_KEYLEN], mode;
+	char			*res;
+	size_t			 reslen, start;
+	int			 status, saved;
+
+	if (fd != -1 || cache_dir() == NULL)
+		return run_query(mp, q, fn, fd, buf, len);
+
+	mode = q->functionq ? 'f' : q->variableq ? 'v' : 'g';
+	cache_hash_init(&ch);
+	cache_hash_add(&ch, cache_build(), strlen(cache_build()) + 1);
+	cache_hash_add(&ch, &mode, 1);
+	cache_hash_add(&ch, q->flags, strlen(q->flags));
+	if (q->itemname != NULL)
+		cache_hash_add(&ch, q->itemname, strlen(q->itemname));
+	cache_hash_add(&ch, "", 1);
+	cache_hash_add(&ch, q->listopts, strlen(q->listopts));
+	if (q->filter != NULL)
+		cache_hash_add(&ch, q->filter, strlen(q->filter));
+	cache_hash_add(&ch, "", 1);
+	cache_hash_add(&ch, formats[oformat], strlen(formats[oformat]) + 1);
+	cache_hash_add(&ch, buf, len);
+	cache_hash_key(&ch, key);
+
+	/* entries are the output followed by the status byte */
+	if ((res = cache_load("results", key, &reslen)) != NULL &&
+	    reslen > 0 && (unsigned char)res[reslen - 1] < MQUERYLEVEL_MAX) {
+		owrite(res, reslen - 1);
+		status = res[reslen - 1];
+		free(res);
+		if (!obuffered && fflush(stdout) == EOF)
+			err((int)MQUERYLEVEL_SYSERR, "stdout");
+		return status;
+	}
+	free(res);
+
+	saved = obuffered;
+	obuffered = 1;
+	start = obuflen;
+	status = run_query(mp, q, fn, fd, buf, len);
+	if (status == MQUERYLEVEL_OK || status == MQUERYLEVEL_NOTFOUND) {
+		obuf_grow(1);
+		obuf[obuflen] = (char)status;
+		cache_store("results", key, obuf + start, obuflen - start + 1);
+	}
+
+	if (!saved) {
+		obuffered = 0;
+		if (fwrite(obuf, 1, obuflen, stdout) != obuflen ||
+		    fflush(stdout) == EOF)
+			err((int)MQUERYLEVEL_SYSERR, "stdout");
+		obuflen = 0;
+	}
+	return status;
+}
+
+/*
+ * Read a page from standard input into memory and run the query on it.
+ */
+static int
+process_stdin(struct mparse *mp, const struct query *q)
+{
+	struct stream	*s;
+	struct page	 pg;
+	int		 status;
+
+	s = stream_open(stdin, STREAM_ONE);
+	if (stream_next(s, &pg) != 1) {
+		warn("stdin");
+		stream_close(s);
+		return (int)MQUERYLEVEL_BADARG;
+	}
+	if (pg.len >= 2 && (unsigned char)pg.buf[0] == 0x1f &&
+	    (unsigned char)pg.buf[1] == 0x8b)
+		page_inflate(&pg);
+	if (pg.err != 0) {
+		warnx("stdin: %s", strerror(pg.err));
+		status = (int)MQUERYLEVEL_BADARG;
+	} else
+		status = query_page(mp, q, pg.fn, -1, pg.buf, pg.len);
+	free(pg.buf);
+	stream_close(s);
+	return status;
+}
+
+/*
+ * Open a page with mandoc, which also finds fn.gz and inflates it,
+ * and run the query on it.  "-" is standard input.
+ */
+static int
+process_file(struct mparse *mp, const struct query *q, const char *fn)
+{
+	int	fd, status;
+
+	if (strcmp(fn, "-") == 0)
+		return process_stdin(mp, q);
+
+	if ((fd = mparse_open(mp, fn)) == -1) {
+		warn("%s", fn);
+		return (int)MQUERYLEVEL_BADARG;
+	}
+	status = query_page(mp, q, fn, fd, NULL, 0);
+	close(fd);
+	return status;
+}
+
+/*
+ * Read and, if needed, inflate a page ourselves, so that the caches
+ * can be used, and run the query on it.
+ */
+static int
+process_cached(struct mparse *mp, const struct query *q, const char *fn)
+{
+	struct page	pg;
+	int		status;
+
+	if (strcmp(fn, "-") == 0)
+		return process_stdin(mp, q);
+	page_read(fn, &pg);
+	if (pg.err == 0 && pg.len >= 2 &&
+	    (unsigned char)pg.buf[0] == 0x1f &&
+	    (unsigned char)pg.buf[1] == 0x8b)
+		page_inflate(&pg);
+	if (pg.err != 0)
+		status = process_file(mp, q, fn);
+	else
+		status = query_page(mp, q, fn, -1, pg.buf, pg.len);
+	free(pg.buf);
+	return status;
+}
+
+/*
+ * Run the query on a page read from an archive or stream, preceded by
+ * a "==> name <==" line.  *nump counts pages across sources.
+ */
+static int
+query_member(struct mparse *mp, const struct query *q, const char *src,
+		struct page *pg, int *nump)
+{
+	int	status;
+
+	page_header((*nump)++ == 0, pg->fn);
+	if (pg->len >= 2 && (unsigned char)pg->buf[0] == 0x1f &&
+	    (unsigned char)pg->buf[1] == 0x8b)
+		page_inflate(pg);
+	if (pg->err != 0) {
+		warnx("%s: %s: %s", src, pg->fn, strerror(pg->err));
+		status = (int)MQUERYLEVEL_BADARG;
+	} else
+		status = query_page(mp, q, pg->fn, -1, pg->buf, pg->len);
+	free(pg->buf);
+	return status;
+}
+
+/*
+ * Run the query on every regular file in a tar archive.
+ */
+static int
+process_tar(struct mparse *mp, const struct query *q, const char *fn,
+		int *nump)
+{
+	struct tar	*t;
+	struct page	 pg;
+	int		 exit_status, status, ret;
+
+	if ((t = tar_open(fn)) == NULL) {
+		warn("%s", fn);
+		return (int)MQUERYLEVEL_BADARG;
+	}
+	exit_status = (int)MQUERYLEVEL_OK;
+	while ((ret = tar_next(t, &pg)) == 1) {
+		status = query_member(mp, q, fn, &pg, nump);
+		if (status > exit_status)
+			exit_status = status;
+	}
+	if (ret == -1) {
+		warnx("%s: damaged archive", fn);
+		exit_status = (int)MQUERYLEVEL_BADARG;
+	}
+	tar_close(t);
+	return exit_status;
+}
+
+/*
+ * Run the query on every page on standard input.
+ */
+static int
+process_stream(struct mparse *mp, const struct query *q,
+		enum stream_kind kind)
+{
+	struct stream	*s;
+	struct page	 pg;
+	int		 exit_status, status, ret, n;
+
+	exit_status = (int)MQUERYLEVEL_OK;
+	n = 0;
+	s = stream_open(stdin, kind);
+	while ((ret = stream_next(s, &pg)) == 1) {
+		status = query_member(mp, q, "stdin", &pg, &n);
+		if (status > exit_status)
+			exit_status = status;
+	}
+	if (ret == -1) {
+		warnx("stdin: damaged stream");
+		exit_status = (int)MQUERYLEVEL_BADARG;
+	}
+	stream_close(s);
+	return exit_status;
+}
+
+/*
+ * Whether files should be read through io_uring.
+ */
+static int
+use_uring(void)
+{
+	const char	*env;
+
+	env = getenv("MQUERY_NO_URING");
+	return env == NULL || *env == '\0';
+}
+
+/*
+ * Name of the output file for page fn with -O.
+ */
+static char *
+output_name(const char *fn)
+{
+	const char	*p;
+	char		*name;
+	size_t		 len;
+
+	if ((p = strrchr(fn, '/')) != NULL)
+		fn = p + 1;
+	len = strlen(fn);
+	if (len > 3 && strcmp(fn + len - 3, ".gz") == 0)
+		len -= 3;
+	if ((name = strndup(fn, len)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	return name;
+}
+
+struct	oname {
+	char		*name;
+	const char	*fn;
+};
+
+static int
+oname_cmp(const void *a, const void *b)
+{
+	const struct oname	*oa = a, *ob = b;
+
+	return strcmp(oa->name, ob->name);
+}
+
+/*
+ * Fail unless each of files writes an output of its own with -O and
+ * none of them the manifest.
+ */
+static void
+outdir_check(char *const files[], int filec)
+{
+	struct oname	*v;
+	int		 i;
+
+	if ((v = reallocarray(NULL, filec, sizeof(v[0]))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	for (i = 0; i < filec; i++) {
+		v[i].name = output_name(files[i]);
+		v[i].fn = files[i];
+		if (strncmp(v[i].name, ".manifest", 9) == 0)
+			errx((int)MQUERYLEVEL_BADARG,
+			    "%s: output would replace the manifest", files[i]);
+	}
+	qsort(v, filec, sizeof(v[0]), oname_cmp);
+	for (i = 1; i < filec; i++)
+		if (strcmp(v[i - 1].name, v[i].name) == 0)
+			errx((int)MQUERYLEVEL_BADARG, "%s and %s both write %s",
+			    v[i - 1].fn, v[i].fn, v[i].name);
+	for (i = 0; i < filec; i++)
+		free(v[i].name);
+	free(v);
+}
+
+/*
+ * The manifest header and path for -O.
+ */
+static void
+outdir_paths(const struct query *q, char **headerp, char **mpathp)
+{
+	if (asprintf(headerp, "mquery-manifest %s %c%s %s -%s %s %s",
+	    cache_build() == NULL ? "-" : cache_build(), q->functionq ? 'f' : q->variableq ? 'v' : 'g',
+	    q->flags, q->itemname == NULL ? "-" : q->itemname, q->listopts,
+	    q->filter == NULL ? "-" : q->filter, formats[oformat]) == -1 ||
+	    asprintf(mpathp, "%s/.manifest", q->outdir) == -1)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+}
+
+/*
+ * Write the output for each of files to its own file in q->outdir,
+ * adding a record for it to new.  Pages with the same contents as
+ * their record in old are not parsed, and outputs are only rewritten
+ * if a section the query looks at changed.  Records in old that were
+ * used are marked as seen.
+ */
+static int
+outdir_pages(struct mparse *mp, const struct query *q, char *const files[],
+		int filec, struct manifest *old, struct manifest *new)
+{
+	struct mpage		*prev, *p;
+	struct flatdoc		 doc;
+	struct pipeline		*pl;
+	struct page		 pg;
+	struct cache_hash	 ch;
+	const char		*names[2];
+	char			*name, *opath;
+	char			 key[CACHE_KEYLEN];
+	int			 exit_status, status, namec;
+
+	/* the sections the query depends on, none means the whole page */
+	/* binary records carry line numbers, which section keys do not */
+	namec = 0;
+	if (!q->functionq && !q->variableq && q->flag != 'V' &&
+	    oformat != OUTPUT_BINARY && query_section(q->flag) != NULL) {
+		names[namec++] = query_section(q->flag);
+		if (q->flag == 'D')
+			names[namec++] = "SEE ALSO";
+	}
+
+	exit_status = (int)MQUERYLEVEL_OK;
+	obuffered = 1;
+	pl = pipeline_open(files, filec, use_uring());
+	while (pipeline_next(pl, &pg)) {
+		name = output_name(pg.fn);
+		if (asprintf(&opath, "%s/%s", q->outdir, name) == -1)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		prev = manifest_find(old, name);
+
+		if (pg.err != 0) {
+			warnx("%s: %s", pg.fn, strerror(pg.err));
+			status = (int)MQUERYLEVEL_BADARG;
+			goto next;
+		}
+
+		cache_hash_init(&ch);
+		cache_hash_add(&ch, pg.buf, pg.len);
+		cache_hash_key(&ch, key);
+		if (prev != NULL && strcmp(prev->key, key) == 0 &&
+		    access(opath, F_OK) == 0) {
+			prev->seen = 1;
+			p = manifest_add(new, name);
+			manifest_copy(p, prev);
+			status = p->status;
+			goto next;
+		}
+
+		if ((status = parse_doc(mp, q, pg.fn, -1, pg.buf, pg.len,
+		    &doc)) == MQUERYLEVEL_OK) {
+			if (prev != NULL)
+				prev->seen = 1;
+			p = manifest_add(new, name);
+			memcpy(p->key, key, CACHE_KEYLEN);
+			manifest_sections(p, &doc);
+			if (namec > 0 && manifest_same(prev, p, names, namec) &&
+			    access(opath, F_OK) == 0)
+				status = prev->status;
+			else {
+				obuflen = 0;
+				status = query_doc(q, pg.fn, &doc);
+				if (publish_file(opath, obuf, obuflen) == -1) {
+					warn("%s", opath);
+					status = (int)MQUERYLEVEL_SYSERR;
+				}
+			}
+			p->status = status;
+		}
+		end_doc(mp, pg.fn);
+
+next:
+		if (status > exit_status)
+			exit_status = status;
+		free(opath);
+		free(name);
+		free(pg.buf);
+	}
+	pipeline_close(pl);
+
+	free(obuf);
+	obuf = NULL;
+	obuflen = obufsize = 0;
+	obuffered = 0;
+	return exit_status;
+}
+
+/*
+ * Remove the outputs of records in m that were not seen.
+ */
+static void
+outdir_sweep(const struct query *q, const struct manifest *m)
+{
+	char	*opath;
+	int	 i;
+
+	for (i = 0; i < m->pagec; i++) {
+		if (m->pages[i].seen)
+			continue;
+		if (asprintf(&opath, "%s/%s", q->outdir,
+		    m->pages[i].name) == -1)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		unlink(opath);
+		free(opath);
+	}
+}
+
+/*
+ * Run -O over all files against the manifest of the last run and
+ * replace it.  If keep is not NULL, the new manifest is stored there,
+ * sorted, instead of being freed.
+ */
+static int
+process_outdir(struct mparse *mp, const struct query *q, char *const files[],
+		int filec, struct manifest *keep)
+{
+	struct manifest	 old, new;
+	char		*header, *mpath;
+	int		 exit_status;
+
+	outdir_check(files, filec);
+	if (mkdir(q->outdir, 0777) == -1 && errno != EEXIST)
+		err((int)MQUERYLEVEL_BADARG, "%s", q->outdir);
+	outdir_paths(q, &header, &mpath);
+	/* outputs of an unknown build are never trusted */
+	if (cache_build() != NULL)
+		manifest_load(&old, mpath, header);
+	else
+		memset(&old, 0, sizeof(old));
+	memset(&new, 0, sizeof(new));
+
+	exit_status = outdir_pages(mp, q, files, filec, &old, &new);
+	/* outputs of pages that are gone or failed */
+	outdir_sweep(q, &old);
+
+	if (manifest_save(&new, mpath, header) == -1 &&
+	    exit_status < MQUERYLEVEL_SYSERR)
+		exit_status = (int)MQUERYLEVEL_SYSERR;
+	manifest_free(&old);
+	if (keep != NULL) {
+		manifest_sort(&new);
+		*keep = new;
+	} else
+		manifest_free(&new);
+	free(mpath);
+	free(header);
+	return exit_status;
+}
+
+static int
+page_filter(const struct dirent *de)
+{
+	if (de->d_name[0] == '.')
+		return 0;
+	return de->d_type == DT_REG || de->d_type == DT_LNK ||
+	    de->d_type == DT_UNKNOWN;
+}
+
+/*
+ * Replace directories in the argument list with the pages in them,
+ * sorted by name.  All strings in the returned vector are allocated.
+ */
+static char **
+expand_args(int *argcp, char *argv[])
+{
+	struct dirent	**names;
+	struct stat	  st;
+	char		**files;
+	int		  filec, filemax, namec, i, j;
+
+	filec = 0;
+	filemax = *argcp;
+	if ((files = reallocarray(NULL, filemax, sizeof(files[0]))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+
+	for (i = 0; i < *argcp; i++) {
+		if (stat(argv[i], &st) == -1 || !S_ISDIR(st.st_mode)) {
+			if ((files[filec++] = strdup(argv[i])) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			continue;
+		}
+
+		if ((namec = scandir(argv[i], &names, page_filter,
+		    alphasort)) == -1)
+			err((int)MQUERYLEVEL_BADARG, "%s", argv[i]);
+		filemax += namec;
+		if ((files = reallocarray(files, filemax,
+		    sizeof(files[0]))) == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		for (j = 0; j < namec; j++) {
+			if (asprintf(&files[filec++], "%s/%s", argv[i],
+			    names[j]->d_name) == -1)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			free(names[j]);
+		}
+		free(names);
+	}
+
+	*argcp = filec;
+	return files;
+}
+
+/*
+ * -w: wait for changes after the first run.  Events are collected
+ * until WATCH_QUIET ms pass without one or WATCH_MAX ms after the
+ * first, so that a page written in pieces or a whole tree being
+ * installed is done once.
+ */
+#define	WATCH_QUIET	50
+#define	WATCH_MAX	500
+#define	WATCH_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | \
+			 IN_MOVED_FROM)
+
+struct	watch {
+	int		 wd;
+	const char	*dir;
+	const char	*only; /* the one page watched in dir, or NULL */
+	char		*buf;
+};
+
+static long
+elapsed_ms(const struct timespec *since)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 +
+	    (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Read pending events into the changed paths, adding each one once.
+ * Returns -1 if events were lost.
+ */
+static int
+watch_read(int fd, const struct watch *w, int wc, char ***pathsp,
+		int *pathcp)
+{
+	char				 buf[4096 + sizeof(struct inotify_event)
+					     + NAME_MAX + 1]
+					     __attribute__((aligned(8)));
+	const struct inotify_event	*ev;
+	char				*path, **paths;
+	ssize_t				 len;
+	int				 i;
+
+	if ((len = read(fd, buf, sizeof(buf))) == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		err((int)MQUERYLEVEL_SYSERR, "inotify");
+	}
+	for (ev = (void *)buf; (char *)ev < buf + len;
+	     ev = (void *)((char *)(ev + 1) + ev->len)) {
+		if (ev->mask & IN_Q_OVERFLOW)
+			return -1;
+		if (ev->len == 0 || ev->name[0] == '.')
+			continue;
+		for (i = 0; i < wc; i++)
+			if (w[i].wd == ev->wd)
+				break;
+		if (i == wc ||
+		    (w[i].only != NULL && strcmp(w[i].only, ev->name) != 0))
+			continue;
+
+		if (asprintf(&path, "%s/%s", w[i].dir, ev->name) == -1)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		for (i = 0; i < *pathcp; i++)
+			if (strcmp((*pathsp)[i], path) == 0)
+				break;
+		if (i < *pathcp) {
+			free(path);
+			continue;
+		}
+		if ((paths = reallocarray(*pathsp, *pathcp + 1,
+		    sizeof(paths[0]))) == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		paths[(*pathcp)++] = path;
+		*pathsp = paths;
+	}
+	return 0;
+}
+
+/*
+ * Fail if a page among the watched args other than path writes the
+ * same output.
+ */
+static void
+watch_check(char *const args[], int argc, const char *path)
+{
+	struct stat	 st, ost;
+	char		*name, *other, *oname;
+	int		 i, j;
+
+	if (stat(path, &st) == -1)
+		return;
+	name = output_name(path);
+	for (i = 0; i < argc; i++)
+		for (j = 0; j < 2; j++) {
+			if (stat(args[i], &ost) == 0 && S_ISDIR(ost.st_mode)) {
+				if (asprintf(&other, "%s/%s%s", args[i], name,
+				    j == 0 ? "" : ".gz") == -1)
+					err((int)MQUERYLEVEL_SYSERR, NULL);
+			} else if (j == 0) {
+				if ((other = strdup(args[i])) == NULL)
+					err((int)MQUERYLEVEL_SYSERR, NULL);
+			} else
+				continue;
+			oname = output_name(other);
+			if (strcmp(oname, name) == 0 &&
+			    stat(other, &ost) == 0 && S_ISREG(ost.st_mode) &&
+			    (ost.st_dev != st.st_dev ||
+			     ost.st_ino != st.st_ino))
+				errx((int)MQUERYLEVEL_BADARG,
+				    "%s and %s both write %s", other, path,
+				    name);
+			free(oname);
+			free(other);
+		}
+	free(name);
+}
+
+/*
+ * Bring q->outdir up to date with the changed paths: outputs of pages
+ * that are gone are removed, the others are done again against the
+ * manifest of the previous round.
+ */
+static void
+watch_update(struct mparse *mp, const struct query *q, struct manifest *m,
+		char *const args[], int argc, char *const paths[], int pathc)
+{
+	struct manifest	 new;
+	struct stat	 st;
+	char		*header, *mpath, *name, *opath;
+	char		**files;
+	int		 filec, i;
+
+	if ((files = reallocarray(NULL, pathc, sizeof(files[0]))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	filec = 0;
+	for (i = 0; i < pathc; i++)
+		if (stat(paths[i], &st) == 0 && S_ISREG(st.st_mode)) {
+			watch_check(args, argc, paths[i]);
+			files[filec++] = paths[i];
+		}
+
+	memset(&new, 0, sizeof(new));
+	outdir_pages(mp, q, files, filec, m, &new);
+	manifest_sort(&new);
+
+	/* pages that are gone or failed */
+	for (i = 0; i < pathc; i++) {
+		name = output_name(paths[i]);
+		if (manifest_find(&new, name) == NULL) {
+			if (asprintf(&opath, "%s/%s", q->outdir, name) == -1)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			unlink(opath);
+			free(opath);
+			manifest_remove(m, name);
+		}
+		free(name);
+	}
+	manifest_merge(m, &new);
+	manifest_free(&new);
+	free(files);
+
+	outdir_paths(q, &header, &mpath);
+	manifest_save(m, mpath, header);
+	free(mpath);
+	free(header);
+}
+
+/*
+ * Run -O over the arguments, then keep the output directory up to
+ * date as pages in them are written, moved or removed.  Only changed
+ * pages are parsed again; the manifest of the last round stays in
+ * memory.  Does not return.
+ */
+static void
+watch_outdir(struct mparse *mp, const struct query *q, char *const args[],
+		int argc)
+{
+	struct manifest	  m;
+	struct watch	 *w;
+	struct timespec	  first;
+	struct pollfd	  pfd;
+	struct stat	  st;
+	char		**files, **paths, *p;
+	int		  fd, filec, pathc, lost, timeout, nready, i;
+
+	if ((fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1)
+		err((int)MQUERYLEVEL_SYSERR, "inotify");
+	if ((w = reallocarray(NULL, argc, sizeof(w[0]))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	for (i = 0; i < argc; i++) {
+		w[i].buf = NULL;
+		w[i].only = NULL;
+		w[i].dir = args[i];
+		if (stat(args[i], &st) == -1 || !S_ISDIR(st.st_mode)) {
+			/* watch the directory, the page may be replaced */
+			if ((w[i].buf = strdup(args[i])) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			if ((p = strrchr(w[i].buf, '/')) == NULL) {
+				w[i].dir = ".";
+				w[i].only = args[i];
+			} else {
+				*p = '\0';
+				w[i].dir = p == w[i].buf ? "/" : w[i].buf;
+				w[i].only = p + 1;
+			}
+		}
+		if ((w[i].wd = inotify_add_watch(fd, w[i].dir,
+		    WATCH_EVENTS)) == -1)
+			err((int)MQUERYLEVEL_BADARG, "%s", w[i].dir);
+	}
+
+	lost = 1;
+	memset(&m, 0, sizeof(m));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (lost) {
+			/* from scratch, pages may have come and gone */
+			filec = argc;
+			files = expand_args(&filec, (char **)args);
+			manifest_free(&m);
+			process_outdir(mp, q, files, filec, &m);
+			for (i = 0; i < filec; i++)
+				free(files[i]);
+			free(files);
+			lost = 0;
+		}
+
+		paths = NULL;
+		pathc = 0;
+		timeout = -1;
+		while ((nready = poll(&pfd, 1, timeout)) != 0) {
+			if (nready == -1) {
+				if (errno == EINTR)
+					continue;
+				err((int)MQUERYLEVEL_SYSERR, "poll");
+			}
+			if (pfd.revents & POLLIN && watch_read(fd, w, argc,
+			    &paths, &pathc) == -1)
+				lost = 1;
+			if (timeout == -1) {
+				clock_gettime(CLOCK_MONOTONIC, &first);
+				timeout = WATCH_QUIET;
+			} else if (elapsed_ms(&first) >= WATCH_MAX)
+				break;
+		}
+
+		if (!lost && pathc > 0)
+			watch_update(mp, q, &m, args, argc, paths, pathc);
+		for (i = 0; i < pathc; i++)
+			free(paths[i]);
+		free(paths);
+	}
+}
+
+static void
+print_header(int i, int filec, const char *fn)
+{
+	if (filec < 2)
+		return;
+	page_header(i == 0, fn);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct mparse	       *mp;
+	struct query		q;
+	struct pipeline	       *pl;
+	struct page		pg;
+	const char	       *optstring, *errstr;
+	char		      **files;
+	char			errbuf[128];
+	int			flagc, exit_status, status, i, n;
+	char			ch;
+
+	memset(&q, 0, sizeof(q));
+	optstring = "0BDFHISVO:T:Zabdegmq:stuwx:z";
+	if (strcasecmp(program_invocation_short_name, "mquery-function") == 0) {
+		q.functionq = 1;
+		optstring = "DdiruF:O:Zgtwz";
+	}
+	if (strcasecmp(program_invocation_short_name, "mquery-variable") == 0) {
+		q.variableq = 1;
+		optstring = "DdiopruO:V:Zgtwz";
+	}
+
+	flagc = 0;
+	while ((ch = getopt(argc, argv, optstring)) != -1) {
+		switch (ch) {
+		case 'F':
+		case 'V':
+			if (q.functionq || q.variableq) {
+				q.itemname = optarg;
+				break;
+			}
+			/* FALLTHROUGH */
+		case 'B':
+		case 'D':
+		case 'H':
+		case 'I':
+		case 'S':
+		case 'a':
+		case 'b':
+		case 'd':
+		case 'i':
+		case 'e':
+		case 'm':
+		case 'o':
+		case 'p':
+		case 'r':
+			if (flagc == sizeof(q.flags) - 1)
+				goto usage;
+			q.flags[flagc++] = q.flag = ch;
+			break;
+		case '0':
+			itemopts.nul = 1;
+			break;
+		case 's':
+			itemopts.sort = 1;
+			break;
+		case 'u':
+			if (!q.functionq && !q.variableq) {
+				itemopts.unique = 1;
+				break;
+			}
+			if (flagc == sizeof(q.flags) - 1)
+				goto usage;
+			q.flags[flagc++] = q.flag = ch;
+			break;
+		case 'x':
+			q.filter = optarg;
+			break;
+		case 'T':
+			for (i = 0; i < (int)(sizeof(formats) /
+			    sizeof(formats[0])); i++)
+				if (strcmp(optarg, formats[i]) == 0)
+					break;
+			if (i == (int)(sizeof(formats) / sizeof(formats[0])))
+				errx((int)MQUERYLEVEL_BADARG,
+				    "%s: unknown output format", optarg);
+			oformat = i;
+			break;
+		case 'q':
+			if (q.itemname != NULL ||
+			    flagc == sizeof(q.flags) - 1)
+				goto usage;
+			q.itemname = optarg;
+			q.flags[flagc++] = q.flag = ch;
+			break;
+		case 'O':
+			q.outdir = optarg;
+			break;
+		case 'g':
+			q.stream = 1;
+			q.kind = STREAM_GIT;
+			break;
+		case 'z':
+			q.stream = 1;
+			q.kind = STREAM_NUL;
+			break;
+		case 'Z':
+			q.stream = 1;
+			q.kind = STREAM_LEN;
+			break;
+		case 't':
+			q.tar = 1;
+			break;
+		case 'w':
+			q.watch = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if ((argc < 1) != q.stream || flagc < 1)
+		goto usage;
+	if (flagc > 1 && (q.functionq || q.variableq))
+		goto usage;
+	if (flagc > 1)
+		q.flag = QUERY_MULTI;
+	if (q.filter != NULL) {
+		if ((i = regcomp(&itemopts.re, q.filter,
+		    REG_EXTENDED | REG_NOSUB)) != 0) {
+			regerror(i, &itemopts.re, errbuf, sizeof(errbuf));
+			errx((int)MQUERYLEVEL_BADARG, "%s: %s", q.filter,
+			    errbuf);
+		}
+		itemopts.filter = 1;
+	}
+	if (itemopts.nul && oformat != OUTPUT_TEXT)
+		goto usage;
+	snprintf(q.listopts, sizeof(q.listopts), "%s%s%s",
+	    itemopts.sort ? "s" : "", itemopts.unique ? "u" : "",
+	    itemopts.nul ? "0" : "");
+	if (q.itemname != NULL && !q.functionq && !q.variableq &&
+	    (qselector = selector_compile(q.itemname, &errstr)) == NULL)
+		errx((int)MQUERYLEVEL_BADARG, "%s: %s", q.itemname, errstr);
+	if (q.itemname == NULL && (q.functionq || q.variableq))
+		goto usage;
+	if (q.watch && q.outdir == NULL)
+		goto usage;
+	if ((q.tar || q.stream) && q.outdir != NULL)
+		goto usage;
+	if (q.tar && q.stream)
+		goto usage;
+	/* standard input is one page, read once */
+	for (i = n = 0; i < argc; i++)
+		if (strcmp(argv[i], "-") == 0)
+			n++;
+	if (n > 0 && (q.tar || q.outdir != NULL))
+		errx((int)MQUERYLEVEL_BADARG,
+		    "-: standard input cannot be used with -O or -t");
+	if (n > 1)
+		errx((int)MQUERYLEVEL_BADARG,
+		    "-: standard input given more than once");
+
+	mchars_alloc();
+	mp = mparse_alloc(MPARSE_MDOC | MPARSE_VALIDATE | MPARSE_UTF8,
+			  MANDOC_OS_OTHER, NULL);
+	assert(mp);
+
+	if (q.watch)
+		watch_outdir(mp, &q, argv, argc);
+	files = expand_args(&argc, argv);
+	exit_status = (int)MQUERYLEVEL_OK;
+	if (q.stream)
+		exit_status = process_stream(mp, &q, q.kind);
+	else if (q.tar) {
+		for (i = n = 0; i < argc; i++) {
+			status = process_tar(mp, &q, files[i], &n);
+			if (status > exit_status)
+				exit_status = status;
+		}
+	} else if (q.outdir != NULL)
+		exit_status = process_outdir(mp, &q, files, argc, NULL);
+	else if (argc == 1) {
+		if (cache_dir() != NULL)
+			exit_status = process_cached(mp, &q, files[0]);
+		else
+			exit_status = process_file(mp, &q, files[0]);
+	} else {
+		/* read and inflate ahead, write behind */
+		obuffered = 1;
+		pl = pipeline_open(files, argc, use_uring());
+		for (i = 0; pipeline_next(pl, &pg); i++) {
+			print_header(i, argc, pg.fn);
+			if (pg.err != 0)
+				status = process_file(mp, &q, pg.fn);
+			else
+				status = query_page(mp, &q, pg.fn, -1,
+						    pg.buf, pg.len);
+			free(pg.buf);
+			if (status > exit_status)
+				exit_status = status;
+
+			pipeline_write(pl, obuf, obuflen);
+			obuf = NULL;
+			obuflen = obufsize = 0;
+		}
+		pipeline_close(pl);
+	}
 
+	for (i = 0; i < argc; i++)
+		free(files[i]);
+	free(files);
+	if (qselector != NULL)
+		selector_free(qselector);
+	if (itemopts.filter)
+		regfree(&itemopts.re);
 	mparse_free(mp);
 	mchars_free();
+	arena_free(&doc_arena);
 	return exit_status;
 
 usage:
-	if (functionq)
+	if (q.functionq)
 		fprintf(stderr,
-			"usage: mquery-function -D|d|i|r|u\n"
-			"                       -F function file\n");
-	else if (variableq)
+			"usage: mquery-function -D|d|i|r|u [-O outdir [-w] | -t]\n"
+			"                       -F function file | directory ...\n"
+			"       mquery-function -D|d|i|r|u -g|z|Z -F function\n");
+	else if (q.variableq)
 		fprintf(stderr,
-			"usage: mquery-variable -D|d|i|o|p|r|u\n"
-			"                       -V variable file\n");
+			"usage: mquery-variable -D|d|i|o|p|r|u [-O outdir [-w] | -t]\n"
+			"                       -V variable file | directory ...\n"
+			"       mquery-variable -D|d|i|o|p|r|u -g|z|Z -V variable\n");
 	else
 		fprintf(stderr,
-			"usage: mquery -B|D|F|V|a|b|d|e|m file\n");
+			"usage: mquery -B|D|F|H|I|S|V|a|b|d|e|m|q selector ...\n"
+			"              [-0su] [-x regex] [-T format]\n"
+			"              [-O outdir [-w] | -t] file | directory ...\n"
+			"       mquery -B|D|F|H|I|S|V|a|b|d|e|m|q selector ...\n"
+			"              [-0su] [-x regex] [-T format] -g|z|Z\n");
 	return (int)MQUERYLEVEL_BADARG;
 }
@@ -0,0 +1,15 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+enum	mquerylevel {
+	MQUERYLEVEL_OK = 0, /* succesful query */
+	MQUERYLEVEL_NOTFOUND, /* failed query */
+	MQUERYLEVEL_ERROR,  /* invalid input document */
+	MQUERYLEVEL_UNSUPP, /* input needs unimplemented features */
+	MQUERYLEVEL_BADARG, /* bad argument in invocation */
+	MQUERYLEVEL_SYSERR, /* system error */
+	MQUERYLEVEL_MAX
+};
@@ -0,0 +1,226 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Interpose the glibc allocator to count what mquery and libmandoc
+ * allocate.  Sizes are taken from malloc_usable_size(), so the numbers
+ * include allocator rounding but not chunk headers.
+ *
+ * The counters are kept per thread, so a report only covers what the
+ * reporting thread allocated and not the pipeline threads reading and
+ * inflating the next pages.  A block is charged to the thread that
+ * frees it, which can make the net figure of a phase negative.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mstats.h"
+
+extern char	*program_invocation_short_name;
+
+void	*__libc_malloc(size_t size);
+void	*__libc_calloc(size_t nmemb, size_t size);
+void	*__libc_realloc(void *ptr, size_t size);
+void	*__libc_memalign(size_t alignment, size_t size);
+void	*__libc_valloc(size_t size);
+void	*__libc_pvalloc(size_t size);
+void	 __libc_free(void *ptr);
+
+void	*malloc(size_t size);
+void	*calloc(size_t nmemb, size_t size);
+void	*realloc(void *ptr, size_t size);
+void	*reallocarray(void *ptr, size_t nmemb, size_t size);
+void	 free(void *ptr);
+void	*memalign(size_t alignment, size_t size);
+void	*aligned_alloc(size_t alignment, size_t size);
+int	 posix_memalign(void **memptr, size_t alignment, size_t size);
+void	*valloc(size_t size);
+void	*pvalloc(size_t size);
+
+static __thread struct mstats	total;
+
+static void
+account_alloc(void *p)
+{
+	size_t	size;
+
+	if (p == NULL)
+		return;
+
+	size = malloc_usable_size(p);
+	total.count++;
+	total.bytes += size;
+	total.live += size;
+
+	/* live may have wrapped below zero through foreign frees */
+	if ((ssize_t)(total.live - total.peak) > 0)
+		total.peak = total.live;
+}
+
+static void
+account_free(void *p)
+{
+	if (p != NULL)
+		total.live -= malloc_usable_size(p);
+}
+
+void *
+malloc(size_t size)
+{
+	void	*p;
+
+	p = __libc_malloc(size);
+	account_alloc(p);
+	return p;
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void	*p;
+
+	p = __libc_calloc(nmemb, size);
+	account_alloc(p);
+	return p;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	void	*p;
+	size_t	 oldsize;
+
+	/* glibc frees the block, count it like free() does */
+	if (ptr != NULL && size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	oldsize = ptr == NULL ? 0 : malloc_usable_size(ptr);
+	if ((p = __libc_realloc(ptr, size)) == NULL)
+		return NULL;
+
+	/* a resize counts as one allocation of the new size */
+	total.live -= oldsize;
+	account_alloc(p);
+	return p;
+}
+
+/*
+ * glibc's reallocarray() calls its internal realloc, so it has to be
+ * interposed on its own to see what libmandoc grows that way.
+ */
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, nmemb * size);
+}
+
+void
+free(void *ptr)
+{
+	account_free(ptr);
+	__libc_free(ptr);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	void	*p;
+
+	p = __libc_memalign(alignment, size);
+	account_alloc(p);
+	return p;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void	*p;
+
+	if (alignment % sizeof(void *) != 0 ||
+	    (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	if ((p = memalign(alignment, size)) == NULL)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+void *
+valloc(size_t size)
+{
+	void	*p;
+
+	p = __libc_valloc(size);
+	account_alloc(p);
+	return p;
+}
+
+void *
+pvalloc(size_t size)
+{
+	void	*p;
+
+	p = __libc_pvalloc(size);
+	account_alloc(p);
+	return p;
+}
+
+/*
+ * Start a measurement: remember the counters and restart the
+ * high-water mark from the current live size.
+ */
+void
+mstats_mark(struct mstats *ms)
+{
+	ms->count = total.count;
+	ms->bytes = total.bytes;
+	ms->live = total.live;
+	total.peak = ms->live;
+	ms->peak = ms->live;
+}
+
+/*
+ * Report what happened since mstats_mark().
+ */
+void
+mstats_report(const char *fn, const char *phase, const struct mstats *ms)
+{
+	fprintf(stderr, "%s: %s: %s: %zu allocs, %zu bytes, "
+	    "peak %+zd live, %+zd net\n", program_invocation_short_name,
+	    fn, phase, total.count - ms->count, total.bytes - ms->bytes,
+	    (ssize_t)(total.peak - ms->live),
+	    (ssize_t)(total.live - ms->live));
+}
+
+void
+mstats_rss(const char *fn)
+{
+	struct rusage	ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return;
+	fprintf(stderr, "%s: %s: peak RSS %ld KiB\n",
+	    program_invocation_short_name, fn, ru.ru_maxrss);
+}
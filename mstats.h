@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Allocation accounting, compiled in with -DMQUERY_MSTATS (make MSTATS=1).
+ * Without it the calls below expand to nothing.
+ */
+
+struct	mstats {
+	size_t	count;	/* number of allocations */
+	size_t	bytes;	/* bytes allocated */
+	size_t	live;	/* bytes currently allocated */
+	size_t	peak;	/* high-water mark of live bytes */
+};
+
+#ifdef MQUERY_MSTATS
+void	mstats_mark(struct mstats *ms);
+void	mstats_report(const char *fn, const char *phase,
+		const struct mstats *ms);
+void	mstats_rss(const char *fn);
+#else
+#define	mstats_mark(ms)			(void)(ms)
+#define	mstats_report(fn, phase, ms)	(void)(ms)
+#define	mstats_rss(fn)			do { } while (0)
+#endif
@@ -0,0 +1,423 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "cache.h"
+#include "mquery.h"
+#include "uring.h"
+#include "pipeline.h"
+
+#define	QUEUE_DEPTH	16 /* pages waiting between two stages */
+#define	PREFETCH_AHEAD	4 /* files the plain reader asks the kernel for */
+
+struct	job {
+	struct page	 pg;
+	char		*out; /* output for the writer */
+	size_t		 outlen;
+	struct job	*next;
+};
+
+struct	queue {
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 nonempty;
+	pthread_cond_t	 nonfull;
+	struct job	*head;
+	struct job	*tail;
+	int		 len;
+	int		 closed; /* no more pushes */
+};
+
+struct	pipeline {
+	struct queue	 readq; /* reader to inflater */
+	struct queue	 parseq; /* inflater to caller */
+	struct queue	 writeq; /* caller to writer */
+	pthread_t	 reader;
+	pthread_t	 inflater;
+	pthread_t	 writer;
+	char *const	*files;
+	int		 nfiles;
+	int		 uring;
+};
+
+static void	 queue_init(struct queue *q);
+static void	 queue_free(struct queue *q);
+static void	 queue_push(struct queue *q, struct job *j);
+static struct job *queue_pop(struct queue *q);
+static void	 queue_close(struct queue *q);
+static struct job *new_job(void);
+static void	 prefetch(const char *fn);
+static void	*reader_main(void *arg);
+static void	*inflater_main(void *arg);
+static void	*writer_main(void *arg);
+
+static void
+queue_init(struct queue *q)
+{
+	memset(q, 0, sizeof(*q));
+	if (pthread_mutex_init(&q->lock, NULL) != 0 ||
+	    pthread_cond_init(&q->nonempty, NULL) != 0 ||
+	    pthread_cond_init(&q->nonfull, NULL) != 0)
+		errx((int)MQUERYLEVEL_SYSERR, "cannot create queue");
+}
+
+static void
+queue_free(struct queue *q)
+{
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->nonempty);
+	pthread_cond_destroy(&q->nonfull);
+}
+
+static void
+queue_push(struct queue *q, struct job *j)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->len == QUEUE_DEPTH)
+		pthread_cond_wait(&q->nonfull, &q->lock);
+	j->next = NULL;
+	if (q->tail == NULL)
+		q->head = j;
+	else
+		q->tail->next = j;
+	q->tail = j;
+	q->len++;
+	pthread_cond_signal(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Oldest job, or NULL once the queue is closed and drained.
+ */
+static struct job *
+queue_pop(struct queue *q)
+{
+	struct job	*j;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->len == 0 && !q->closed)
+		pthread_cond_wait(&q->nonempty, &q->lock);
+	if ((j = q->head) != NULL) {
+		if ((q->head = j->next) == NULL)
+			q->tail = NULL;
+		q->len--;
+		pthread_cond_signal(&q->nonfull);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return j;
+}
+
+static void
+queue_close(struct queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->nonempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static struct job *
+new_job(void)
+{
+	struct job	*j;
+
+	if ((j = calloc(1, sizeof(*j))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	return j;
+}
+
+/*
+ * Start reading a file we are going to need soon.
+ */
+static void
+prefetch(const char *fn)
+{
+	int	fd;
+
+	if (strcmp(fn, "-") == 0 ||
+	    (fd = open(fn, O_RDONLY | O_CLOEXEC)) == -1)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+/*
+ * Read a whole file with plain reads.  "-" is left to the caller,
+ * with err set to ESPIPE.
+ */
+void
+page_read(const char *fn, struct page *pg)
+{
+	struct stat	 st;
+	ssize_t		 nr;
+	int		 fd;
+
+	memset(pg, 0, sizeof(*pg));
+	pg->fn = fn;
+	if (strcmp(fn, "-") == 0) {
+		pg->err = ESPIPE;
+		return;
+	}
+	if ((fd = open(fn, O_RDONLY | O_CLOEXEC)) == -1) {
+		pg->err = errno;
+		return;
+	}
+	if (fstat(fd, &st) == -1) {
+		pg->err = errno;
+		close(fd);
+		return;
+	}
+	pg->dev = st.st_dev;
+	pg->ino = st.st_ino;
+	pg->mtime = st.st_mtim;
+	if (!S_ISREG(st.st_mode))
+		pg->err = EINVAL;
+	else if ((pg->buf = malloc(st.st_size + 1)) == NULL)
+		pg->err = ENOMEM;
+	else {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		while (pg->len < (size_t)st.st_size &&
+		    (nr = read(fd, pg->buf + pg->len,
+		    st.st_size - pg->len)) != 0) {
+			if (nr == -1 && errno == EINTR)
+				continue;
+			if (nr == -1) {
+				pg->err = errno;
+				break;
+			}
+			pg->len += nr;
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Replace a gzipped page by its contents.  Concatenated members are
+ * joined like gzread() does.  On failure, err is set and mandoc gets
+ * to report the problem.  With a cache directory, inflated pages are
+ * kept there, keyed by the identity of the compressed file.
+ */
+void
+page_inflate(struct page *pg)
+{
+	z_stream	 zs;
+	char		 key[128];
+	char		*out, *p;
+	size_t		 outlen, outsize;
+	uInt		 avail;
+	int		 ret;
+
+	/* pages that are no files of their own have no identity */
+	if (cache_dir() != NULL && pg->ino != 0) {
+		snprintf(key, sizeof(key), "%llx-%llx-%zu-%lld.%09ld",
+		    (unsigned long long)pg->dev, (unsigned long long)pg->ino,
+		    pg->len, (long long)pg->mtime.tv_sec, pg->mtime.tv_nsec);
+		if ((out = cache_load("gz", key, &outlen)) != NULL) {
+			free(pg->buf);
+			pg->buf = out;
+			pg->len = outlen;
+			return;
+		}
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		pg->err = ENOMEM;
+		return;
+	}
+	zs.next_in = (Bytef *)pg->buf;
+	zs.avail_in = pg->len;
+
+	outlen = 0;
+	outsize = pg->len * 4;
+	if ((out = malloc(outsize)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	for (;;) {
+		if (outlen == outsize) {
+			outsize *= 2;
+			if ((p = realloc(out, outsize)) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			out = p;
+		}
+		zs.next_out = (Bytef *)out + outlen;
+		zs.avail_out = avail = outsize - outlen > UINT_MAX ?
+		    UINT_MAX : outsize - outlen;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		outlen += avail - zs.avail_out;
+
+		if (ret == Z_STREAM_END) {
+			if (zs.avail_in == 0)
+				break;
+			if (inflateReset(&zs) == Z_OK)
+				continue;
+		} else if (ret == Z_OK)
+			continue;
+		free(out);
+		inflateEnd(&zs);
+		pg->err = EILSEQ;
+		return;
+	}
+	inflateEnd(&zs);
+
+	if (cache_dir() != NULL && pg->ino != 0)
+		cache_store("gz", key, out, outlen);
+	free(pg->buf);
+	pg->buf = out;
+	pg->len = outlen;
+}
+
+static void *
+reader_main(void *arg)
+{
+	struct pipeline	*pl = arg;
+	struct batch	*b;
+	struct job	*j;
+	int		 i, k;
+
+	b = pl->uring ? batch_open(pl->files, pl->nfiles) : NULL;
+	if (b != NULL) {
+		for (j = new_job(); batch_next(b, &j->pg); j = new_job())
+			queue_push(&pl->readq, j);
+		free(j);
+		batch_close(b);
+	} else for (i = 0; i < pl->nfiles; i++) {
+		/* keep the kernel reading PREFETCH_AHEAD files ahead */
+		for (k = i == 0 ? 1 : i + PREFETCH_AHEAD;
+		     k <= i + PREFETCH_AHEAD && k < pl->nfiles; k++)
+			prefetch(pl->files[k]);
+
+		j = new_job();
+		page_read(pl->files[i], &j->pg);
+		queue_push(&pl->readq, j);
+	}
+	queue_close(&pl->readq);
+	return NULL;
+}
+
+static void *
+inflater_main(void *arg)
+{
+	struct pipeline	*pl = arg;
+	struct job	*j;
+
+	while ((j = queue_pop(&pl->readq)) != NULL) {
+		if (j->pg.err == 0 && j->pg.len >= 2 &&
+		    (unsigned char)j->pg.buf[0] == 0x1f &&
+		    (unsigned char)j->pg.buf[1] == 0x8b)
+			page_inflate(&j->pg);
+		queue_push(&pl->parseq, j);
+	}
+	queue_close(&pl->parseq);
+	return NULL;
+}
+
+static void *
+writer_main(void *arg)
+{
+	struct pipeline	*pl = arg;
+	struct job	*j;
+
+	while ((j = queue_pop(&pl->writeq)) != NULL) {
+		if (j->outlen > 0 &&
+		    fwrite(j->out, 1, j->outlen, stdout) != j->outlen)
+			err((int)MQUERYLEVEL_SYSERR, "stdout");
+		if (fflush(stdout) == EOF)
+			err((int)MQUERYLEVEL_SYSERR, "stdout");
+		free(j->out);
+		free(j);
+	}
+	return NULL;
+}
+
+/*
+ * Start the threads for reading files.  With uring set, io_uring is
+ * tried before plain reads.
+ */
+struct pipeline *
+pipeline_open(char *const files[], int nfiles, int uring)
+{
+	struct pipeline	*pl;
+
+	if ((pl = calloc(1, sizeof(*pl))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	pl->files = files;
+	pl->nfiles = nfiles;
+	pl->uring = uring;
+	queue_init(&pl->readq);
+	queue_init(&pl->parseq);
+	queue_init(&pl->writeq);
+
+	if (pthread_create(&pl->reader, NULL, reader_main, pl) != 0 ||
+	    pthread_create(&pl->inflater, NULL, inflater_main, pl) != 0 ||
+	    pthread_create(&pl->writer, NULL, writer_main, pl) != 0)
+		errx((int)MQUERYLEVEL_SYSERR, "cannot start threads");
+	return pl;
+}
+
+/*
+ * Wait for the next page in order and return 1, or 0 after the last.
+ * A page with err set could not be read or inflated.  The caller
+ * frees the buffer of the page.
+ */
+int
+pipeline_next(struct pipeline *pl, struct page *pg)
+{
+	struct job	*j;
+
+	if ((j = queue_pop(&pl->parseq)) == NULL)
+		return 0;
+	*pg = j->pg;
+	free(j);
+	return 1;
+}
+
+/*
+ * Queue output for stdout, buf is freed once written.
+ */
+void
+pipeline_write(struct pipeline *pl, char *buf, size_t len)
+{
+	struct job	*j;
+
+	j = new_job();
+	j->out = buf;
+	j->outlen = len;
+	queue_push(&pl->writeq, j);
+}
+
+/*
+ * Wait until all pages were handed out and all output is written.
+ */
+void
+pipeline_close(struct pipeline *pl)
+{
+	struct page	pg;
+
+	while (pipeline_next(pl, &pg))
+		free(pg.buf);
+	queue_close(&pl->writeq);
+	pthread_join(pl->reader, NULL);
+	pthread_join(pl->inflater, NULL);
+	pthread_join(pl->writer, NULL);
+	queue_free(&pl->readq);
+	queue_free(&pl->parseq);
+	queue_free(&pl->writeq);
+	free(pl);
+}
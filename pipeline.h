@@ -0,0 +1,22 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Multi-file pipeline.  A reader thread reads pages (through io_uring
+ * if asked to and possible), an inflater thread decompresses gzipped
+ * ones and a writer thread copies finished output to stdout, while the
+ * calling thread parses and queries.  Stages are connected by bounded
+ * queues and keep the order of the files.  Needs "uring.h".
+ */
+
+struct	pipeline;
+
+struct pipeline	*pipeline_open(char *const files[], int nfiles, int uring);
+int		 pipeline_next(struct pipeline *pl, struct page *pg);
+void		 pipeline_write(struct pipeline *pl, char *buf, size_t len);
+void		 pipeline_close(struct pipeline *pl);
+void		 page_read(const char *fn, struct page *pg);
+void		 page_inflate(struct page *pg);
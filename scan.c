@@ -0,0 +1,322 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <mandoc/mandoc.h>
+#include <mandoc/roff.h>
+
+#include "scan.h"
+
+#define	MAXWORDS 32
+
+struct	macro {
+	uint32_t	 key;
+	enum roff_tok	 tok;
+};
+
+struct	word {
+	const char	*p;
+	size_t		 len;
+};
+
+static uint32_t		 macro_key(const char *p, size_t len);
+static int		 macro_cmp(const void *a, const void *b);
+static void		 macros_init(void);
+static enum roff_tok	 macro_lookup(const char *p, size_t len);
+static size_t		 split_words(const char *p, const char *end,
+				struct word *w, size_t maxw);
+
+/* Requests and macros mandoc accepts in mdoc(7) pages, sorted by key. */
+static struct macro	 macros[(ROFF_MAX - ROFF_br) + (MDOC_MAX - MDOC_Dd)];
+static size_t		 macroc;
+
+static uint32_t
+macro_key(const char *p, size_t len)
+{
+	uint32_t	key = 0;
+
+	if (len == 0 || len > 3)
+		return 0;
+	while (len-- > 0)
+		key = key << 8 | (unsigned char)*p++;
+	return key;
+}
+
+static int
+macro_cmp(const void *a, const void *b)
+{
+	const struct macro	*ma = a, *mb = b;
+
+	return ma->key < mb->key ? -1 : ma->key > mb->key;
+}
+
+static void
+macros_init(void)
+{
+	const char	*name;
+	int		 tok;
+
+	for (tok = ROFF_br; tok < MDOC_MAX; tok++) {
+		if (tok == ROFF_MAX)
+			tok = MDOC_Dd;
+		name = roff_name[tok];
+		macros[macroc].key = macro_key(name, strlen(name));
+		macros[macroc++].tok = (enum roff_tok)tok;
+	}
+	qsort(macros, macroc, sizeof(macros[0]), macro_cmp);
+}
+
+static enum roff_tok
+macro_lookup(const char *p, size_t len)
+{
+	struct macro	 key, *m;
+
+	if ((key.key = macro_key(p, len)) == 0)
+		return TOKEN_NONE;
+	m = bsearch(&key, macros, macroc, sizeof(macros[0]), macro_cmp);
+	return m == NULL ? TOKEN_NONE : m->tok;
+}
+
+/*
+ * Split on blanks.  Returns more than maxw if there are too many words.
+ */
+static size_t
+split_words(const char *p, const char *end, struct word *w, size_t maxw)
+{
+	size_t	wc = 0;
+
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == end)
+			return wc;
+		if (wc == maxw)
+			return maxw + 1;
+		w[wc].p = p;
+		while (p < end && *p != ' ' && *p != '\t')
+			p++;
+		w[wc].len = p - w[wc].p;
+		wc++;
+	}
+}
+
+/*
+ * Look for control lines that could produce a head deroffing to name
+ * (compared the same way as first_node_by_name() does).  The text of
+ * such a head only consists of words from its macro line, so a line
+ * that lacks one of the words of name cannot match.  Anything that
+ * can create text or macros out of thin air makes the answer unsure:
+ * unknown requests (.so, .de, .ds, .if, ...), escapes and quotes on
+ * candidate lines, line continuations and text-generating macros.
+ */
+enum scan_res
+scan_head(const char *buf, size_t len, const char *name,
+		struct scan_hit *hit)
+{
+	struct word	 target[MAXWORDS], args[MAXWORDS], text[MAXWORDS];
+	struct word	 nmname[MAXWORDS];
+	const char	*p, *q, *eol, *end;
+	enum scan_res	 res;
+	enum roff_tok	 tok, atok;
+	size_t		 targetc, argc, textc, nmnamec, i, j;
+	int		 dropped, superset;
+
+	if (macroc == 0)
+		macros_init();
+
+	targetc = split_words(name, name + strlen(name), target, MAXWORDS);
+	if (targetc == 0 || targetc > MAXWORDS)
+		return SCAN_UNSURE;
+	for (i = 0; i < targetc; i++)
+		if (macro_lookup(target[i].p, target[i].len) >= MDOC_Dd)
+			return SCAN_UNSURE;
+
+	nmnamec = 0;
+	res = SCAN_ABSENT;
+	end = buf + len;
+	for (p = buf; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if (eol > p && eol[-1] == '\\')
+			return SCAN_UNSURE;
+		if (*p != '.' && *p != '\'')
+			continue;
+
+		for (q = p + 1; q < eol && (*q == ' ' || *q == '\t'); q++)
+			continue;
+		if (q == eol || (q[0] == '\\' && q + 1 < eol && q[1] == '"'))
+			continue;
+		for (i = 0; q + i < eol && q[i] != ' ' && q[i] != '\t'; i++)
+			continue;
+		if ((tok = macro_lookup(q, i)) == TOKEN_NONE)
+			return SCAN_UNSURE;
+
+		switch (tok) {
+		case MDOC_Sh:
+		case MDOC_Ss:
+		case MDOC_It:
+		case MDOC_Nm:
+		case MDOC_Fo:
+		case MDOC_Eo:
+			break;
+		default:
+			continue;
+		}
+
+		if (memchr(q, '\\', eol - q) != NULL ||
+		    memchr(q, '"', eol - q) != NULL)
+			return SCAN_UNSURE;
+		argc = split_words(q + i, eol, args, MAXWORDS);
+		if (argc > MAXWORDS)
+			return SCAN_UNSURE;
+
+		/* a bare .Nm prints the name of the first .Nm */
+		if (tok == MDOC_Nm && nmnamec == 0 && argc > 0) {
+			memcpy(nmname, args, argc * sizeof(args[0]));
+			nmnamec = argc;
+		}
+
+		textc = dropped = 0;
+		if (tok == MDOC_Nm && argc == 0) {
+			if (nmnamec == 0)
+				return SCAN_UNSURE;
+			memcpy(text, nmname, nmnamec * sizeof(text[0]));
+			textc = nmnamec;
+		}
+		for (j = 0; j < argc; j++) {
+			atok = macro_lookup(args[j].p, args[j].len);
+			switch (atok) {
+			case TOKEN_NONE:
+				text[textc++] = args[j];
+				continue;
+			case MDOC_Ap:
+			case MDOC_At:
+			case MDOC_Bsx:
+			case MDOC_Bt:
+			case MDOC_Bx:
+			case MDOC_Dx:
+			case MDOC_Ex:
+			case MDOC_Fx:
+			case MDOC_Lb:
+			case MDOC_Nm:
+			case MDOC_Nx:
+			case MDOC_Ox:
+			case MDOC_Rv:
+			case MDOC_St:
+			case MDOC_Ud:
+			case MDOC_Ux:
+			case MDOC_Xo:
+				return SCAN_UNSURE;
+			default:
+				if (atok < MDOC_Dd)
+					text[textc++] = args[j];
+				else
+					dropped = 1;
+				continue;
+			}
+		}
+
+		if (res != SCAN_ABSENT)
+			continue;
+
+		superset = 1;
+		for (i = 0; i < targetc && superset; i++) {
+			superset = 0;
+			for (j = 0; j < textc && !superset; j++)
+				superset = text[j].len == target[i].len &&
+				    strncasecmp(text[j].p, target[i].p,
+				    target[i].len) == 0;
+		}
+		if (!superset)
+			continue;
+
+		res = SCAN_FOUND;
+		if (hit == NULL)
+			continue;
+		hit->offset = p - buf;
+		hit->tok = tok;
+		hit->exact = !dropped && textc == targetc;
+		for (i = 0; i < targetc && hit->exact; i++)
+			hit->exact = text[i].len == target[i].len &&
+			    strncasecmp(text[i].p, target[i].p,
+			    target[i].len) == 0;
+	}
+
+	return res;
+}
+
+/*
+ * Offset of the first .Sh line starting at or after from,
+ * or len if there is none.
+ */
+size_t
+scan_next_sh(const char *buf, size_t len, size_t from)
+{
+	const char	*p, *q, *eol, *end;
+
+	end = buf + len;
+	p = buf + from;
+	if (from > 0 && p[-1] != '\n') {
+		if ((p = memchr(p, '\n', end - p)) == NULL)
+			return len;
+		p++;
+	}
+
+	for (; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if (*p != '.' && *p != '\'')
+			continue;
+		for (q = p + 1; q < eol && (*q == ' ' || *q == '\t'); q++)
+			continue;
+		if (eol - q >= 2 && q[0] == 'S' && q[1] == 'h' &&
+		    (eol - q == 2 || q[2] == ' ' || q[2] == '\t'))
+			return p - buf;
+	}
+	return len;
+}
+
+/*
+ * Whether a control line in buf[from, to) may set roff state that
+ * lines after it use: strings, macros, registers, included files, fill
+ * mode, fonts, or a conditional or loop that could do any of these.
+ */
+int
+scan_sets_state(const char *buf, size_t from, size_t to)
+{
+	static const char *const reqs[] = {
+		"am", "am1", "ami", "ami1", "as", "as1", "de", "de1", "dei",
+		"dei1", "ds", "ds1", "el", "fi", "ft", "ie", "if", "nf", "nr",
+		"rm", "rn", "so", "tr", "while"
+	};
+	const char	*p, *q, *name, *eol, *end;
+	size_t		 i, len;
+
+	end = buf + to;
+	for (p = buf + from; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if (*p != '.' && *p != '\'')
+			continue;
+		for (q = p + 1; q < eol && (*q == ' ' || *q == '\t'); q++)
+			continue;
+		for (name = q; q < eol && *q != ' ' && *q != '\t' &&
+		     *q != '\\'; q++)
+			continue;
+		len = q - name;
+		for (i = 0; i < sizeof(reqs) / sizeof(reqs[0]); i++)
+			if (strlen(reqs[i]) == len &&
+			    memcmp(reqs[i], name, len) == 0)
+				return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Raw-text scanner answering "can this page have a head named X?"
+ * without running the parser.  Needs <mandoc/mandoc.h> and
+ * <mandoc/roff.h>.
+ */
+
+enum	scan_res {
+	SCAN_ABSENT = 0, /* no head can deroff to the name */
+	SCAN_FOUND, /* some line may produce such a head */
+	SCAN_UNSURE /* only the parser can tell */
+};
+
+struct	scan_hit {
+	size_t		 offset; /* start of the first candidate line */
+	enum roff_tok	 tok; /* its macro */
+	int		 exact; /* the line deroffs to exactly the name */
+};
+
+enum scan_res	 scan_head(const char *buf, size_t len, const char *name,
+			struct scan_hit *hit);
+size_t		 scan_next_sh(const char *buf, size_t len, size_t from);
+int		 scan_sets_state(const char *buf, size_t from, size_t to);
@@ -0,0 +1,306 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#define _GNU_SOURCE /* strndup() */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <mandoc/mandoc.h>
+#include <mandoc/roff.h>
+
+#include "arena.h"
+#include "flat.h"
+#include "mquery.h"
+#include "selector.h"
+
+/*
+ * Grammar:
+ *
+ *	selector = ["/" | "//"] step {("/" | "//") step}
+ *	step	 = ("*" | "head" | "body" | "text" | macro) ["[" text "]"]
+ *
+ * "/" looks at children and "//" at all descendants; a selector
+ * without a leading "/" starts with "//".  Heads and bodies of blocks
+ * count as children unless asked for by name, so "It/Ic" finds the
+ * macro in the head of an item.  "[text]" compares, ignoring case,
+ * the deroffed head of a block or the text of a node or of its first
+ * child.
+ */
+
+enum	step_kind {
+	STEP_ANY,
+	STEP_MACRO,
+	STEP_HEAD,
+	STEP_BODY,
+	STEP_TEXT
+};
+
+struct	step {
+	enum step_kind	 kind;
+	enum roff_tok	 tok; /* for STEP_MACRO */
+	int		 deep; /* descendants instead of children */
+	char		*text; /* or NULL */
+};
+
+struct	selector {
+	struct step	*steps;
+	int		 stepc;
+};
+
+static enum roff_tok	 macro_tok(const char *name, size_t len);
+static const char	*node_text(const struct flatdoc *doc, uint32_t n);
+static int		 step_matches(const struct step *st,
+				const struct flatdoc *doc, uint32_t n);
+static uint32_t		 subtree_end(const struct flatdoc *doc, uint32_t n);
+static void		 match_children(const struct selector *sel, int i,
+				const struct flatdoc *doc, uint32_t n,
+				uint8_t *hits);
+static void		 match_at(const struct selector *sel, int i,
+				const struct flatdoc *doc, uint32_t n,
+				uint8_t *hits);
+static void		 match_from(const struct selector *sel, int i,
+				const struct flatdoc *doc, uint32_t ctx,
+				uint8_t *hits);
+
+static enum roff_tok
+macro_tok(const char *name, size_t len)
+{
+	int	tok;
+
+	for (tok = MDOC_Dd; tok < MDOC_MAX; tok++)
+		if (strlen(roff_name[tok]) == len &&
+		    strncmp(roff_name[tok], name, len) == 0)
+			return (enum roff_tok)tok;
+	return TOKEN_NONE;
+}
+
+/*
+ * Compile expr, or return NULL and a message in *errp.
+ */
+struct selector *
+selector_compile(const char *expr, const char **errp)
+{
+	struct selector	*sel;
+	struct step	*st;
+	const char	*p, *end;
+	size_t		 len;
+
+	if ((sel = calloc(1, sizeof(*sel))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	p = expr;
+	do {
+		if ((st = reallocarray(sel->steps, sel->stepc + 1,
+		    sizeof(*st))) == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		sel->steps = st;
+		st += sel->stepc++;
+		memset(st, 0, sizeof(*st));
+
+		st->deep = 1;
+		if (p[0] == '/') {
+			st->deep = p[1] == '/';
+			p += st->deep ? 2 : 1;
+		} else if (p != expr) {
+			*errp = "expected /";
+			goto fail;
+		}
+
+		len = strcspn(p, "/[");
+		if (len == 0) {
+			*errp = "empty step";
+			goto fail;
+		}
+		if (len == 1 && *p == '*')
+			st->kind = STEP_ANY;
+		else if (len == 4 && strncmp(p, "head", 4) == 0)
+			st->kind = STEP_HEAD;
+		else if (len == 4 && strncmp(p, "body", 4) == 0)
+			st->kind = STEP_BODY;
+		else if (len == 4 && strncmp(p, "text", 4) == 0)
+			st->kind = STEP_TEXT;
+		else if ((st->tok = macro_tok(p, len)) != TOKEN_NONE)
+			st->kind = STEP_MACRO;
+		else {
+			*errp = "unknown macro";
+			goto fail;
+		}
+		p += len;
+
+		if (*p == '[') {
+			if ((end = strchr(++p, ']')) == NULL) {
+				*errp = "missing ]";
+				goto fail;
+			}
+			if ((st->text = strndup(p, end - p)) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+			p = end + 1;
+		}
+	} while (*p != '\0');
+	return sel;
+
+fail:
+	selector_free(sel);
+	return NULL;
+}
+
+void
+selector_free(struct selector *sel)
+{
+	int	i;
+
+	for (i = 0; i < sel->stepc; i++)
+		free(sel->steps[i].text);
+	free(sel->steps);
+	free(sel);
+}
+
+static const char *
+node_text(const struct flatdoc *doc, uint32_t n)
+{
+	if (doc->htext[n] != FLAT_NONE)
+		return doc->pool + doc->htext[n];
+	if (doc->text[n] != FLAT_NONE)
+		return doc->pool + doc->text[n];
+	n = doc->child[n];
+	if (n != FLAT_NONE && doc->text[n] != FLAT_NONE)
+		return doc->pool + doc->text[n];
+	return NULL;
+}
+
+static int
+step_matches(const struct step *st, const struct flatdoc *doc, uint32_t n)
+{
+	const char	*text;
+
+	switch (st->kind) {
+	case STEP_ANY:
+		break;
+	case STEP_MACRO:
+		/* the block, not its head, body or tail */
+		if (doc->tok[n] != st->tok || doc->type[n] == ROFFT_HEAD ||
+		    doc->type[n] == ROFFT_BODY || doc->type[n] == ROFFT_TAIL)
+			return 0;
+		break;
+	case STEP_HEAD:
+		if (doc->type[n] != ROFFT_HEAD)
+			return 0;
+		break;
+	case STEP_BODY:
+		if (doc->type[n] != ROFFT_BODY)
+			return 0;
+		break;
+	case STEP_TEXT:
+		if (doc->type[n] != ROFFT_TEXT)
+			return 0;
+		break;
+	}
+	if (st->text == NULL)
+		return 1;
+	text = node_text(doc, n);
+	return text != NULL && strcasecmp(text, st->text) == 0;
+}
+
+/*
+ * In preorder, the subtree of n ends where the next sibling of n or
+ * of one of its ancestors starts.
+ */
+static uint32_t
+subtree_end(const struct flatdoc *doc, uint32_t n)
+{
+	for (; n != FLAT_NONE && doc->next[n] == FLAT_NONE; n = doc->parent[n])
+		continue;
+	return n == FLAT_NONE ? doc->nodec : doc->next[n];
+}
+
+/*
+ * Node n matched step i - 1, go on with step i.
+ */
+static void
+match_at(const struct selector *sel, int i, const struct flatdoc *doc,
+		uint32_t n, uint8_t *hits)
+{
+	if (i == sel->stepc)
+		hits[n] = 1;
+	else
+		match_from(sel, i, doc, n, hits);
+}
+
+static void
+match_children(const struct selector *sel, int i, const struct flatdoc *doc,
+		uint32_t n, uint8_t *hits)
+{
+	const struct step	*st = &sel->steps[i];
+
+	for (n = doc->child[n]; n != FLAT_NONE; n = doc->next[n]) {
+		if (step_matches(st, doc, n))
+			match_at(sel, i + 1, doc, n, hits);
+		else if ((doc->type[n] == ROFFT_HEAD ||
+		    doc->type[n] == ROFFT_BODY) &&
+		    st->kind != STEP_HEAD && st->kind != STEP_BODY)
+			match_children(sel, i, doc, n, hits);
+	}
+}
+
+/*
+ * Find the nodes below ctx matching step i.
+ */
+static void
+match_from(const struct selector *sel, int i, const struct flatdoc *doc,
+		uint32_t ctx, uint8_t *hits)
+{
+	const struct step	*st = &sel->steps[i];
+	uint32_t		 n, m, end;
+
+	if (!st->deep) {
+		match_children(sel, i, doc, ctx, hits);
+		return;
+	}
+
+	/* sections only appear at the top, subsections right below */
+	if (st->kind == STEP_MACRO && st->tok == MDOC_Sh && ctx != 0)
+		return;
+	if (st->kind == STEP_MACRO && ctx == 0 &&
+	    (st->tok == MDOC_Sh || st->tok == MDOC_Ss)) {
+		for (n = doc->child[0]; n != FLAT_NONE; n = doc->next[n]) {
+			if (st->tok == MDOC_Sh) {
+				if (step_matches(st, doc, n))
+					match_at(sel, i + 1, doc, n, hits);
+				continue;
+			}
+			if (doc->tok[n] != MDOC_Sh ||
+			    (m = flat_body(doc, n)) == FLAT_NONE)
+				continue;
+			for (m = doc->child[m]; m != FLAT_NONE;
+			     m = doc->next[m])
+				if (step_matches(st, doc, m))
+					match_at(sel, i + 1, doc, m, hits);
+		}
+		return;
+	}
+
+	end = subtree_end(doc, ctx);
+	for (n = ctx + 1; n < end; n++)
+		if (step_matches(st, doc, n))
+			match_at(sel, i + 1, doc, n, hits);
+}
+
+/*
+ * Mark the nodes of doc the selector matches in hits, which has room
+ * for doc->nodec flags.
+ */
+void
+selector_match(const struct selector *sel, const struct flatdoc *doc,
+		uint8_t *hits)
+{
+	if (doc->nodec > 0)
+		match_from(sel, 0, doc, 0, hits);
+}
@@ -0,0 +1,19 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Path selectors over a flattened page, such as
+ * "Sh[FUNCTIONS]/Bl/It/head/Ic" or "Ss[Optional variables]//Va".
+ * A selector is compiled once into a list of steps and can then be
+ * matched against any number of pages.  Needs "flat.h".
+ */
+
+struct	selector;
+
+struct selector	*selector_compile(const char *expr, const char **errp);
+void		 selector_match(const struct selector *sel,
+			const struct flatdoc *doc, uint8_t *hits);
+void		 selector_free(struct selector *sel);
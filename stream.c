@@ -0,0 +1,238 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#define _GNU_SOURCE /* getline() */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mquery.h"
+#include "uring.h"
+#include "stream.h"
+
+#define	STREAM_BUFSIZE	(128 * 1024)
+#define	STREAM_PAGEMAX	(64 * 1024 * 1024) /* largest page in a header */
+
+struct	stream {
+	FILE		*f;
+	enum stream_kind kind;
+	char		*line; /* the current header, names the page */
+	size_t		 linesz;
+	char		 num[24]; /* names numbered pages */
+	int		 pagec;
+};
+
+static int	 read_size(const char *p, char **endp, size_t *sizep);
+static int	 read_data(struct stream *s, size_t len, struct page *pg);
+static int	 next_one(struct stream *s, struct page *pg);
+static int	 next_nul(struct stream *s, struct page *pg);
+static int	 next_len(struct stream *s, struct page *pg);
+static int	 next_git(struct stream *s, struct page *pg);
+
+/*
+ * Parse the size of a page in a header: decimal digits only, and no
+ * more than STREAM_PAGEMAX.
+ */
+static int
+read_size(const char *p, char **endp, size_t *sizep)
+{
+	unsigned long long	size;
+
+	if (*p < '0' || *p > '9')
+		return -1;
+	errno = 0;
+	size = strtoull(p, endp, 10);
+	if (errno != 0 || size > STREAM_PAGEMAX)
+		return -1;
+	*sizep = size;
+	return 0;
+}
+
+static int
+read_data(struct stream *s, size_t len, struct page *pg)
+{
+	if ((pg->buf = malloc(len + 1)) == NULL)
+		return -1;
+	if (fread(pg->buf, 1, len, s->f) != len) {
+		free(pg->buf);
+		pg->buf = NULL;
+		return -1;
+	}
+	pg->buf[len] = '\0';
+	pg->len = len;
+	return 0;
+}
+
+static int
+next_one(struct stream *s, struct page *pg)
+{
+	size_t	 size, nr;
+	char	*p;
+
+	if (s->pagec++ > 0)
+		return 0;
+	memset(pg, 0, sizeof(*pg));
+	pg->fn = "-";
+	size = STREAM_BUFSIZE;
+	if ((pg->buf = malloc(size)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	while ((nr = fread(pg->buf + pg->len, 1, size - pg->len - 1,
+	    s->f)) > 0) {
+		pg->len += nr;
+		if (pg->len + 1 < size)
+			continue;
+		size *= 2;
+		if ((p = realloc(pg->buf, size)) == NULL)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+		pg->buf = p;
+	}
+	if (ferror(s->f)) {
+		free(pg->buf);
+		return -1;
+	}
+	pg->buf[pg->len] = '\0';
+	return 1;
+}
+
+/*
+ * The buffer getdelim() filled is handed out as the page.
+ */
+static int
+next_nul(struct stream *s, struct page *pg)
+{
+	ssize_t	len;
+
+	if ((len = getdelim(&s->line, &s->linesz, '\0', s->f)) <= 0)
+		return ferror(s->f) ? -1 : 0;
+	memset(pg, 0, sizeof(*pg));
+	snprintf(s->num, sizeof(s->num), "%d", ++s->pagec);
+	pg->fn = s->num;
+	pg->buf = s->line;
+	pg->len = s->line[len - 1] == '\0' ? len - 1 : len;
+	pg->buf[pg->len] = '\0';
+	s->line = NULL;
+	s->linesz = 0;
+	return 1;
+}
+
+/*
+ * Each page is preceded by a line with its length in bytes and,
+ * after a blank, its name.
+ */
+static int
+next_len(struct stream *s, struct page *pg)
+{
+	char	*end;
+	ssize_t	 len;
+	size_t	 size;
+
+	if ((len = getline(&s->line, &s->linesz, s->f)) <= 0)
+		return ferror(s->f) ? -1 : 0;
+	if (s->line[len - 1] == '\n')
+		s->line[--len] = '\0';
+	if (read_size(s->line, &end, &size) == -1 ||
+	    (*end != '\0' && *end != ' '))
+		return -1;
+
+	memset(pg, 0, sizeof(*pg));
+	s->pagec++;
+	if (*end == ' ' && end[1] != '\0')
+		pg->fn = end + 1;
+	else {
+		snprintf(s->num, sizeof(s->num), "%d", s->pagec);
+		pg->fn = s->num;
+	}
+	return read_data(s, size, pg) == -1 ? -1 : 1;
+}
+
+/*
+ * Each object is "oid type size", a newline, its contents and another
+ * newline.  Objects git could not find are handed out with ENOENT,
+ * objects other than blobs are skipped.
+ */
+static int
+next_git(struct stream *s, struct page *pg)
+{
+	char		*type, *end;
+	ssize_t		 len;
+	size_t		 size;
+
+	for (;;) {
+		if ((len = getline(&s->line, &s->linesz, s->f)) <= 0)
+			return ferror(s->f) ? -1 : 0;
+		if (s->line[len - 1] == '\n')
+			s->line[--len] = '\0';
+		if ((type = strchr(s->line, ' ')) == NULL)
+			return -1;
+		*type++ = '\0';
+		memset(pg, 0, sizeof(*pg));
+		pg->fn = s->line;
+		if (strcmp(type, "missing") == 0 ||
+		    strcmp(type, "ambiguous") == 0) {
+			pg->err = ENOENT;
+			return 1;
+		}
+		if ((end = strchr(type, ' ')) == NULL)
+			return -1;
+		*end++ = '\0';
+		if (read_size(end, &end, &size) == -1 || *end != '\0')
+			return -1;
+
+		if (read_data(s, size, pg) == -1 || getc(s->f) != '\n') {
+			free(pg->buf);
+			return -1;
+		}
+		if (strcmp(type, "blob") == 0)
+			return 1;
+		free(pg->buf);
+	}
+}
+
+struct stream *
+stream_open(FILE *f, enum stream_kind kind)
+{
+	struct stream	*s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	s->f = f;
+	s->kind = kind;
+	setvbuf(f, NULL, _IOFBF, STREAM_BUFSIZE);
+	return s;
+}
+
+/*
+ * Read the next page into pg.  pg->fn is good until the next call.
+ * Returns 0 at the end of the stream and -1 if it is damaged.
+ */
+int
+stream_next(struct stream *s, struct page *pg)
+{
+	switch (s->kind) {
+	case STREAM_ONE:
+		return next_one(s, pg);
+	case STREAM_NUL:
+		return next_nul(s, pg);
+	case STREAM_LEN:
+		return next_len(s, pg);
+	case STREAM_GIT:
+		return next_git(s, pg);
+	}
+	abort();
+}
+
+void
+stream_close(struct stream *s)
+{
+	free(s->line);
+	free(s);
+}
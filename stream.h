@@ -0,0 +1,23 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Read many pages from one stream into memory, one after the other.
+ * Needs <stdio.h> and "uring.h".
+ */
+
+enum	stream_kind {
+	STREAM_ONE, /* the whole stream is one page */
+	STREAM_NUL, /* pages ended by NUL bytes, numbered from 1 */
+	STREAM_LEN, /* "length [name]" lines, each followed by a page */
+	STREAM_GIT /* git cat-file --batch output, named by object ID */
+};
+
+struct	stream;
+
+struct stream	*stream_open(FILE *f, enum stream_kind kind);
+int		 stream_next(struct stream *s, struct page *pg);
+void		 stream_close(struct stream *s);
@@ -0,0 +1,269 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#define _GNU_SOURCE /* strndup() */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mquery.h"
+#include "uring.h"
+#include "tar.h"
+
+#define	TAR_BLOCK	512
+#define	TAR_BUFSIZE	(128 * 1024) /* for zlib */
+#define	TAR_MAXSIZE	((uint64_t)1 << 30) /* larger members are no pages */
+
+struct	tar {
+	gzFile		 gz; /* also reads uncompressed archives */
+	char		*name; /* of the current member */
+	char		*longname; /* from a GNU or pax header */
+};
+
+static int	 read_full(struct tar *t, void *buf, size_t len);
+static int	 skip(struct tar *t, uint64_t len);
+static char	*read_data(struct tar *t, uint64_t size);
+static int	 header_number(const unsigned char *p, size_t len,
+			uint64_t *np);
+static int	 header_valid(const unsigned char *h);
+static char	*pax_path(const char *recs, size_t len);
+
+static int
+read_full(struct tar *t, void *buf, size_t len)
+{
+	int	nr;
+
+	while (len > 0) {
+		nr = gzread(t->gz, buf, len > TAR_BUFSIZE ? TAR_BUFSIZE :
+		    (unsigned)len);
+		if (nr <= 0)
+			return -1;
+		buf = (char *)buf + nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+static int
+skip(struct tar *t, uint64_t len)
+{
+	char	buf[8 * TAR_BLOCK];
+
+	/* gzseek() would not notice a truncated archive */
+	for (; len > sizeof(buf); len -= sizeof(buf))
+		if (read_full(t, buf, sizeof(buf)) == -1)
+			return -1;
+	return read_full(t, buf, len);
+}
+
+/*
+ * Read the data of a member, padded to whole blocks, into a
+ * NUL-terminated buffer.
+ */
+static char *
+read_data(struct tar *t, uint64_t size)
+{
+	char	*buf;
+
+	if ((buf = malloc(size + 1)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	if (read_full(t, buf, size) == -1 ||
+	    skip(t, -size % TAR_BLOCK) == -1) {
+		free(buf);
+		return NULL;
+	}
+	buf[size] = '\0';
+	return buf;
+}
+
+/*
+ * Numeric header fields are octal, or base-256 if the high bit of the
+ * first byte is set.
+ */
+static int
+header_number(const unsigned char *p, size_t len, uint64_t *np)
+{
+	uint64_t	n;
+	size_t		i;
+
+	n = 0;
+	if (p[0] & 0x80) {
+		for (i = 0; i < len; i++) {
+			if (n >> 56)
+				return -1;
+			n = n << 8 | (i == 0 ? p[i] & 0x7f : p[i]);
+		}
+		*np = n;
+		return 0;
+	}
+	for (i = 0; i < len && p[i] == ' '; i++)
+		continue;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) {
+		if (n >> 61)
+			return -1;
+		n = n << 3 | (p[i] - '0');
+	}
+	if (i < len && p[i] != ' ' && p[i] != '\0')
+		return -1;
+	*np = n;
+	return 0;
+}
+
+/*
+ * Whether the checksum of a header block matches, counting its own
+ * field as blanks.
+ */
+static int
+header_valid(const unsigned char *h)
+{
+	uint64_t	sum, want;
+	int		i;
+
+	if (header_number(h + 148, 8, &want) == -1)
+		return 0;
+	for (sum = 0, i = 0; i < TAR_BLOCK; i++)
+		sum += i >= 148 && i < 156 ? ' ' : h[i];
+	return sum == want;
+}
+
+/*
+ * The path from pax extended header records, "len key=value\n" each.
+ */
+static char *
+pax_path(const char *recs, size_t len)
+{
+	const char	*p, *end, *val;
+	char		*path;
+	unsigned long	 reclen;
+
+	path = NULL;
+	for (p = recs; p < recs + len; p += reclen) {
+		reclen = strtoul(p, (char **)&val, 10);
+		if (reclen == 0 || reclen > (size_t)(recs + len - p) ||
+		    *val != ' ')
+			break;
+		end = p + reclen - 1; /* the newline */
+		val++;
+		if (end - val > 5 && strncmp(val, "path=", 5) == 0) {
+			free(path);
+			if ((path = strndup(val + 5, end - val - 5)) == NULL)
+				err((int)MQUERYLEVEL_SYSERR, NULL);
+		}
+	}
+	return path;
+}
+
+/*
+ * Open an archive, or return NULL with errno set.
+ */
+struct tar *
+tar_open(const char *fn)
+{
+	struct tar	*t;
+	int		 fd;
+
+	if ((fd = open(fn, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if ((t->gz = gzdopen(fd, "rb")) == NULL) {
+		close(fd);
+		free(t);
+		errno = ENOMEM;
+		return NULL;
+	}
+	gzbuffer(t->gz, TAR_BUFSIZE);
+	return t;
+}
+
+/*
+ * Read the next regular file of the archive into pg.  pg->fn is its
+ * name, good until the next call.  Returns 0 at the end of the
+ * archive and -1 if it is damaged.
+ */
+int
+tar_next(struct tar *t, struct page *pg)
+{
+	unsigned char	 h[TAR_BLOCK];
+	char		*data;
+	uint64_t	 size, mtime;
+	int		 nr, type;
+
+	for (;;) {
+		if ((nr = gzread(t->gz, h, sizeof(h))) == 0 &&
+		    t->longname == NULL)
+			return 0; /* tolerate missing end-of-archive blocks */
+		if (nr != sizeof(h))
+			return -1;
+		if (h[0] == '\0')
+			return 0; /* end-of-archive blocks */
+		if (!header_valid(h) || header_number(h + 124, 12,
+		    &size) == -1 || header_number(h + 136, 12, &mtime) == -1)
+			return -1;
+		type = h[156];
+
+		if (type == 'L' || type == 'x') {
+			if (size > TAR_MAXSIZE ||
+			    (data = read_data(t, size)) == NULL)
+				return -1;
+			free(t->longname);
+			t->longname = type == 'L' ? data :
+			    pax_path(data, size);
+			if (type == 'x')
+				free(data);
+			continue;
+		}
+		if ((type != '0' && type != '\0' && type != '7') ||
+		    size > TAR_MAXSIZE) {
+			/* directories, links, global pax headers, ... */
+			free(t->longname);
+			t->longname = NULL;
+			if (skip(t, size + (-size % TAR_BLOCK)) == -1)
+				return -1;
+			continue;
+		}
+		break;
+	}
+
+	free(t->name);
+	if (t->longname != NULL) {
+		t->name = t->longname;
+		t->longname = NULL;
+	} else if (h[345] != '\0' && memcmp(h + 257, "ustar", 5) == 0) {
+		if (asprintf(&t->name, "%.155s/%.100s", h + 345, h) == -1)
+			err((int)MQUERYLEVEL_SYSERR, NULL);
+	} else if ((t->name = strndup((char *)h, 100)) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+
+	memset(pg, 0, sizeof(*pg));
+	pg->fn = t->name;
+	pg->mtime.tv_sec = mtime;
+	if ((pg->buf = read_data(t, size)) == NULL)
+		return -1;
+	pg->len = size;
+	return 1;
+}
+
+void
+tar_close(struct tar *t)
+{
+	gzclose(t->gz);
+	free(t->name);
+	free(t->longname);
+	free(t);
+}
@@ -0,0 +1,17 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Read the regular files of a tar archive, gzipped or not, one after
+ * the other into memory.  Understands ustar, GNU long names and pax
+ * path records.  Needs "uring.h".
+ */
+
+struct	tar;
+
+struct tar	*tar_open(const char *fn);
+int		 tar_next(struct tar *t, struct page *pg);
+void		 tar_close(struct tar *t);
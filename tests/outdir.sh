@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# SPDX-FileType: SOURCE
+# SPDX-License-Identifier: EUPL-1.2+
+# SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+#
+# Run queries with -O on every page, shift its lines down by one and
+# run them again, then compare each output file with what the query
+# prints on standard output.  Catches outputs -O keeps although they
+# changed.
+#
+# usage: outdir.sh mquery page ...
+
+mquery=$1
+shift
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+unset MQUERY_CACHE_DIR
+
+fail=0
+for page; do
+	name=${page##*/}
+	for format in text binary shell; do
+		for opt in D F I b; do
+			rm -rf "$tmp/out"
+			cp "$page" "$tmp/$name"
+			"$mquery" -$opt -T $format -O "$tmp/out" "$tmp/$name" \
+			    2>/dev/null
+			{ echo '.\" shifted'; cat "$page"; } >"$tmp/$name"
+			"$mquery" -$opt -T $format -O "$tmp/out" "$tmp/$name" \
+			    2>/dev/null
+			"$mquery" -$opt -T $format "$tmp/$name" \
+			    >"$tmp/stdout" 2>/dev/null
+			if ! cmp -s "$tmp/stdout" "$tmp/out/$name"; then
+				echo "FAIL: -$opt -T $format -O $page"
+				fail=1
+			fi
+		done
+	done
+done
+exit $fail
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# SPDX-FileType: SOURCE
+# SPDX-License-Identifier: EUPL-1.2+
+# SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+#
+# Run every global query on every page once on sliced and once on whole
+# pages and compare output and exit status.
+#
+# usage: slice.sh mquery page ...
+
+mquery=$1
+shift
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+unset MQUERY_CACHE_DIR
+
+fail=0
+for page; do
+	for opt in B D F H I S V a b d e m; do
+		MQUERY_NO_SLICE= "$mquery" -$opt "$page" >"$tmp/sliced" 2>&1
+		echo "exit $?" >>"$tmp/sliced"
+		MQUERY_NO_SLICE=1 "$mquery" -$opt "$page" >"$tmp/whole" 2>&1
+		echo "exit $?" >>"$tmp/whole"
+		if ! cmp -s "$tmp/sliced" "$tmp/whole"; then
+			echo "FAIL: -$opt $page"
+			diff -u "$tmp/whole" "$tmp/sliced"
+			fail=1
+		fi
+	done
+done
+exit $fail
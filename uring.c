@@ -0,0 +1,432 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+#define _GNU_SOURCE /* struct statx */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "uring.h"
+
+#ifndef HAVE_IO_URING
+
+struct batch *
+batch_open(char *const files[], int nfiles)
+{
+	return NULL;
+}
+
+int
+batch_next(struct batch *b, struct page *pg)
+{
+	return 0;
+}
+
+void
+batch_close(struct batch *b)
+{
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "mquery.h"
+
+#define	BATCH_WINDOW	32 /* files started and not handed out */
+#define	RING_ENTRIES	(BATCH_WINDOW * 2) /* an openat and a statx each */
+
+/* user_data is the file index shifted left by OP_SHIFT, or'ed with op */
+#define	OP_OPEN		0
+#define	OP_STATX	1
+#define	OP_READ		2
+#define	OP_SHIFT	2
+
+enum	bstate {
+	BFILE_IDLE = 0,
+	BFILE_OPEN, /* openat and statx submitted */
+	BFILE_READ, /* read submitted */
+	BFILE_DONE
+};
+
+struct	bfile {
+	struct statx	 stx;
+	char		*buf;
+	size_t		 len; /* bytes read so far */
+	int		 fd;
+	int		 pending; /* operations still in the ring */
+	int		 err;
+	enum bstate	 state;
+};
+
+struct	ring {
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ptr;
+	void			*cq_ptr;
+	size_t			 sq_sz;
+	size_t			 cq_sz;
+	size_t			 sqes_sz;
+	unsigned		 sq_entries;
+	unsigned		 tail; /* local copy of the SQ tail */
+	int			 fd;
+};
+
+struct	batch {
+	struct ring	 ring;
+	char *const	*files;
+	struct bfile	*f;
+	int		 nfiles;
+	int		 next_in; /* next file to start */
+	int		 next_out; /* next file to hand out */
+	int		 inflight; /* started but not done */
+};
+
+static int		 ring_init(struct ring *r, unsigned entries);
+static void		 ring_free(struct ring *r);
+static struct io_uring_sqe *ring_sqe(struct ring *r);
+static int		 ring_submit(struct ring *r, unsigned wait);
+static int		 ring_cqe(struct ring *r, uint64_t *data, int32_t *res);
+static void		 start_file(struct batch *b, int i);
+static void		 start_read(struct batch *b, int i);
+static void		 complete(struct batch *b, uint64_t data, int32_t res);
+static void		 wait_some(struct batch *b);
+
+static int
+ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params	p;
+	char		       *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return -1;
+
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_sz > r->sq_sz)
+			r->sq_sz = r->cq_sz;
+		r->cq_sz = r->sq_sz;
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ptr = r->cq_ptr = r->sqes = MAP_FAILED;
+	r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ptr = r->sq_ptr;
+	else if ((r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) ==
+	    MAP_FAILED)
+		goto fail;
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_ptr;
+	cq = r->cq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sq_entries = p.sq_entries;
+	r->tail = *r->sq_tail;
+	return 0;
+
+fail:
+	ring_free(r);
+	return -1;
+}
+
+static void
+ring_free(struct ring *r)
+{
+	if (r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_sz);
+	if (r->sq_ptr != MAP_FAILED)
+		munmap(r->sq_ptr, r->sq_sz);
+	close(r->fd);
+}
+
+/*
+ * Next free submission entry, zeroed.  Submits what is queued
+ * if the ring is full.
+ */
+static struct io_uring_sqe *
+ring_sqe(struct ring *r)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		 idx;
+
+	while (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+	    r->sq_entries)
+		if (ring_submit(r, 0) == -1)
+			err((int)MQUERYLEVEL_SYSERR, "io_uring_enter");
+
+	idx = r->tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->tail++;
+	return sqe;
+}
+
+/*
+ * Submit everything queued and wait for at least wait completions.
+ */
+static int
+ring_submit(struct ring *r, unsigned wait)
+{
+	unsigned	submit;
+	int		ret;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	do {
+		ret = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+				   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+static int
+ring_cqe(struct ring *r, uint64_t *data, int32_t *res)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned		 head;
+
+	head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &r->cqes[head & *r->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Queue the openat and the statx of file i; they run in parallel.
+ */
+static void
+start_file(struct batch *b, int i)
+{
+	struct io_uring_sqe	*sqe;
+	struct bfile		*f = &b->f[i];
+
+	f->fd = -1;
+	if (strcmp(b->files[i], "-") == 0) {
+		/* standard input is the caller's, see page_read() */
+		f->err = ESPIPE;
+		f->state = BFILE_DONE;
+		return;
+	}
+	f->pending = 2;
+	f->state = BFILE_OPEN;
+
+	sqe = ring_sqe(&b->ring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)b->files[i];
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	sqe->user_data = (uint64_t)i << OP_SHIFT | OP_OPEN;
+
+	sqe = ring_sqe(&b->ring);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)b->files[i];
+	sqe->len = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME;
+	sqe->off = (uintptr_t)&f->stx;
+	sqe->user_data = (uint64_t)i << OP_SHIFT | OP_STATX;
+
+	b->inflight++;
+}
+
+static void
+start_read(struct batch *b, int i)
+{
+	struct io_uring_sqe	*sqe;
+	struct bfile		*f = &b->f[i];
+
+	f->pending = 1;
+	f->state = BFILE_READ;
+
+	sqe = ring_sqe(&b->ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = f->fd;
+	sqe->addr = (uintptr_t)(f->buf + f->len);
+	sqe->len = f->stx.stx_size - f->len;
+	sqe->off = f->len;
+	sqe->user_data = (uint64_t)i << OP_SHIFT | OP_READ;
+}
+
+static void
+complete(struct batch *b, uint64_t data, int32_t res)
+{
+	struct bfile	*f;
+	int		 i;
+
+	i = (int)(data >> OP_SHIFT);
+	f = &b->f[i];
+	f->pending--;
+
+	if (res < 0) {
+		if (f->err == 0)
+			f->err = -res;
+	} else switch (data & ((1 << OP_SHIFT) - 1)) {
+	case OP_OPEN:
+		f->fd = res;
+		break;
+	case OP_READ:
+		if (res == 0) /* the file shrank */
+			f->stx.stx_size = f->len;
+		f->len += res;
+		break;
+	default:
+		break;
+	}
+	if (f->pending > 0)
+		return;
+
+	if (f->err == 0 && f->state == BFILE_OPEN) {
+		/* the caller deals with anything but regular files */
+		if (!S_ISREG(f->stx.stx_mode))
+			f->err = EINVAL;
+		else if (f->stx.stx_size > 0 &&
+		    (f->buf = malloc(f->stx.stx_size)) == NULL)
+			f->err = ENOMEM;
+	}
+	if (f->err == 0 && f->len < f->stx.stx_size) {
+		start_read(b, i);
+		return;
+	}
+
+	if (f->fd != -1)
+		close(f->fd);
+	f->fd = -1;
+	f->state = BFILE_DONE;
+	b->inflight--;
+}
+
+static void
+wait_some(struct batch *b)
+{
+	uint64_t	data;
+	int32_t		res;
+
+	if (ring_submit(&b->ring, 1) == -1)
+		err((int)MQUERYLEVEL_SYSERR, "io_uring_enter");
+	while (ring_cqe(&b->ring, &data, &res))
+		complete(b, data, res);
+}
+
+/*
+ * Set up a ring for reading files, or return NULL if io_uring
+ * cannot be used.
+ */
+struct batch *
+batch_open(char *const files[], int nfiles)
+{
+	struct batch	*b;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	if ((b->f = calloc(nfiles, sizeof(b->f[0]))) == NULL)
+		err((int)MQUERYLEVEL_SYSERR, NULL);
+	if (ring_init(&b->ring, RING_ENTRIES) == -1) {
+		free(b->f);
+		free(b);
+		return NULL;
+	}
+	b->files = files;
+	b->nfiles = nfiles;
+	return b;
+}
+
+/*
+ * Wait for the next file in order and return 1, or 0 after the last.
+ * The caller frees the buffer of the page.
+ */
+int
+batch_next(struct batch *b, struct page *pg)
+{
+	struct bfile	*f;
+
+	if (b->next_out == b->nfiles)
+		return 0;
+
+	f = &b->f[b->next_out];
+	for (;;) {
+		/* finished files waiting behind a slow one count too */
+		while (b->next_in - b->next_out < BATCH_WINDOW &&
+		    b->next_in < b->nfiles)
+			start_file(b, b->next_in++);
+		if (f->state == BFILE_DONE)
+			break;
+		wait_some(b);
+	}
+
+	pg->fn = b->files[b->next_out];
+	pg->buf = f->buf;
+	pg->len = f->len;
+	pg->dev = makedev(f->stx.stx_dev_major, f->stx.stx_dev_minor);
+	pg->ino = f->stx.stx_ino;
+	pg->mtime.tv_sec = f->stx.stx_mtime.tv_sec;
+	pg->mtime.tv_nsec = f->stx.stx_mtime.tv_nsec;
+	pg->err = f->err;
+	f->buf = NULL;
+	b->next_out++;
+	return 1;
+}
+
+void
+batch_close(struct batch *b)
+{
+	int	i;
+
+	/* the kernel may still be writing into our buffers */
+	while (b->inflight > 0)
+		wait_some(b);
+	for (i = 0; i < b->nfiles; i++)
+		free(b->f[i].buf);
+	ring_free(&b->ring);
+	free(b->f);
+	free(b);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,32 @@
+/*
+ * SPDX-FileType: SOURCE
+ * SPDX-License-Identifier: EUPL-1.2+
+ * SPDX-FileCopyrightText: 2021 Anna “CyberTailor” <cyber@sysrq.in>
+ */
+
+/*
+ * Read many files through one io_uring, talking to the kernel with
+ * raw syscalls.  Compiled in with -DHAVE_IO_URING (make URING=1, the
+ * default); without it or on kernels lacking io_uring, batch_open()
+ * fails and callers read the files themselves.
+ *
+ * Files are opened, stat'ed and read in the background, a window of
+ * them at a time, and handed out in the order they were given.
+ * Needs <sys/types.h> and <time.h>.
+ */
+
+struct	batch;
+
+struct	page {
+	const char	*fn;
+	char		*buf; /* whole file contents, freed by the caller */
+	size_t		 len;
+	dev_t		 dev; /* identity of the file read, */
+	ino_t		 ino; /* for caching */
+	struct timespec	 mtime;
+	int		 err; /* errno of a failed step, 0 if buf is valid */
+};
+
+struct batch	*batch_open(char *const files[], int nfiles);
+int		 batch_next(struct batch *b, struct page *pg);
+void		 batch_close(struct batch *b);